@@ -0,0 +1,368 @@
+/*
+ * Runs dwl-state against dwl-stub and reports cold query latency
+ * percentiles, events per second and peak RSS for every mode.
+ * Run from the top of the tree after `make bench`, or through it.
+ * With -B it fails if cold queries got slower than the budget, which
+ * `make startup` uses to catch libraries creeping into the link.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SOCKET "wayland-bench"
+#define ARGS_MAX 16
+
+/* Structures */
+struct Run {
+    double wall_us, cpu_us;
+    long maxrss_kb;
+};
+
+struct Query {
+    const char *name;
+    const char *args[ARGS_MAX];
+};
+
+/* Functions */
+static void bench_batch(const struct Query *query);
+static void bench_queries(const char *mode, const char *extra, int budget);
+static void bench_watch(void);
+static void check_daemon(void);
+static int  compare_double(const void *a, const void *b);
+static void die(const char *fmt, ...);
+static double now_us(void);
+static double percentile(double *sorted, int amount, int p);
+static pid_t spawn(const char **argv, const char *in, const char *out, const char *err);
+static pid_t start_stub(const char *rate, const char *limit);
+static void stop(pid_t pid);
+static struct Run timed_run(const char **argv, const char *in, const char *err, int check);
+static void wait_for(const char *path);
+
+/* Variables */
+static const char *dwl_state = "./dwl-state",
+                  *dwl_stub = "./bench/dwl-stub",
+                  *outputs = "2",
+                  *tags = "9",
+                  *layouts = "3";
+static int runs = 200,
+           oneshot_only = 0,
+           over_budget = 0;
+static double budget_us = 0;
+static long watch_events = 20000;
+static const char *watch_rate = "10000";
+static char runtime_dir[] = "/tmp/dwl-bench-XXXXXX";
+static char socket_file[256];
+static pid_t stub_pid;
+
+static const struct Query queries[] = {
+    { "title",   { "-a", "-i", "-l", NULL } },
+    { "tags",    { "-a", "-T", "-s", "-c", "-f", NULL } },
+    { "all",     { "-E", "-e", NULL } },
+    { "layouts", { "-L", NULL } },
+    /* Exits before connecting, this is just exec, loading and relocation. */
+    { "version", { "-v", NULL } },
+};
+
+/* Options of the client that the daemon has to answer along with the query. */
+static const struct Query daemon_checks[] = {
+    { "stats",   { "--stats", "-a", "-i", NULL } },
+    { "display", { "--display", SOCKET, "-a", "-i", NULL } },
+};
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+double percentile(double *sorted, int amount, int p) {
+    return sorted[(amount - 1) * p / 100];
+}
+
+void die(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+
+    fprintf(stderr, "error: ");
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+
+    va_end(ap);
+    if (stub_pid)
+        stop(stub_pid);
+    exit(EXIT_FAILURE);
+}
+
+/* The files stand in for stdin, stdout and stderr, stderr is kept without one. */
+pid_t spawn(const char **argv, const char *in, const char *out, const char *err) {
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int error;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, in ? in : "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out ? out : "/dev/null", O_WRONLY, 0);
+    if (err)
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, err, O_WRONLY, 0);
+
+    error = posix_spawn(&pid, argv[0], &actions, NULL, (char**)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error)
+        die("Could not run %s: %s", argv[0], strerror(error));
+
+    return pid;
+}
+
+/* Sockets show up once the server listens, poll for them instead of sleeping blindly. */
+void wait_for(const char *path) {
+    struct stat st;
+
+    for (int i = 0; i < 5000; i++) {
+        if (stat(path, &st) == 0)
+            return;
+        usleep(1000);
+    }
+
+    die("Timed out waiting for %s", path);
+}
+
+void stop(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+pid_t start_stub(const char *rate, const char *limit) {
+    const char *argv[] = { dwl_stub, "-s", SOCKET, "-o", outputs, "-t", tags, "-l", layouts,
+                           "-r", rate, "-c", limit, NULL };
+    pid_t pid;
+
+    unlink(socket_file);
+    pid = spawn(argv, NULL, NULL, NULL);
+    wait_for(socket_file);
+    return pid;
+}
+
+struct Run timed_run(const char **argv, const char *in, const char *err, int check) {
+    struct rusage usage;
+    struct Run run;
+    int status;
+    double start = now_us();
+    pid_t pid = spawn(argv, in, NULL, err);
+
+    if (wait4(pid, &status, 0, &usage) == -1)
+        die("wait4: %s", strerror(errno));
+    run.wall_us = now_us() - start;
+    run.cpu_us = usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec
+               + usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+    run.maxrss_kb = usage.ru_maxrss;
+
+    if (check && (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS))
+        die("%s exited with %d", argv[0], WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+
+    return run;
+}
+
+/* Every query runs cold, as its own process, like a status bar would run it. */
+void bench_queries(const char *mode, const char *extra, int budget) {
+    double *wall = calloc(runs, sizeof(*wall));
+    if (!wall)
+        die("Could not allocate");
+
+    for (size_t q = 0; q < sizeof(queries)/sizeof(*queries); q++) {
+        const char *argv[ARGS_MAX + 2] = { dwl_state };
+        long maxrss = 0;
+        int argc = 1;
+
+        if (extra)
+            argv[argc++] = extra;
+        for (int i = 0; queries[q].args[i]; i++)
+            argv[argc++] = queries[q].args[i];
+
+        for (int i = 0; i < runs; i++) {
+            struct Run run = timed_run(argv, NULL, NULL, 1);
+            wall[i] = run.wall_us;
+            if (run.maxrss_kb > maxrss)
+                maxrss = run.maxrss_kb;
+        }
+
+        qsort(wall, runs, sizeof(*wall), compare_double);
+        printf("%-8s %-8s %10.1f %10.1f %10.1f %10.1f %12s %10ld\n", mode, queries[q].name,
+               percentile(wall, runs, 50), percentile(wall, runs, 90), percentile(wall, runs, 99),
+               wall[runs - 1], "-", maxrss);
+
+        if (budget && budget_us && percentile(wall, runs, 90) > budget_us) {
+            printf("# %s %s: p90 %.1f us is over the budget of %.1f us\n", mode, queries[q].name,
+                   percentile(wall, runs, 90), budget_us);
+            over_budget = 1;
+        }
+    }
+
+    free(wall);
+}
+
+/* One process answering every query from stdin, reported per query. */
+void bench_batch(const struct Query *query) {
+    const char *argv[] = { dwl_state, "-b", NULL };
+    char path[sizeof(runtime_dir) + 16];
+    struct Run run;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/batch", runtime_dir);
+    if (!(file = fopen(path, "w")))
+        die("Could not write %s", path);
+    for (int i = 0; i < runs; i++) {
+        for (int j = 0; query->args[j]; j++)
+            fprintf(file, "%s%s", j ? " " : "", query->args[j]);
+        fputc('\n', file);
+    }
+    fclose(file);
+
+    run = timed_run(argv, path, NULL, 1);
+    unlink(path);
+    printf("%-8s %-8s %10.1f %10s %10s %10s %12.0f %10ld\n", "batch", query->name,
+           run.wall_us / runs, "-", "-", "-", runs / (run.wall_us / 1e6), run.maxrss_kb);
+}
+
+/* Client options the daemon turns down would fail every query through it. */
+void check_daemon(void) {
+    for (size_t q = 0; q < sizeof(daemon_checks)/sizeof(*daemon_checks); q++) {
+        const char *argv[ARGS_MAX + 1] = { dwl_state };
+        int argc = 1;
+
+        for (int i = 0; daemon_checks[q].args[i]; i++)
+            argv[argc++] = daemon_checks[q].args[i];
+        timed_run(argv, NULL, "/dev/null", 1);
+    }
+
+    printf("# daemon: answered %zu checks\n", sizeof(daemon_checks)/sizeof(*daemon_checks));
+}
+
+/*
+ * The stub sends watch_events updates as fast as it is asked to, then exits.
+ * Events per second are per second of dwl-state's cpu time, so they don't
+ * depend on how fast the stub can send them.
+ */
+void bench_watch(void) {
+    const char *argv[] = { dwl_state, "-w", "-F", "-E", "-e", NULL };
+    char limit[32];
+    struct Run run;
+
+    stop(stub_pid);
+    snprintf(limit, sizeof(limit), "%ld", watch_events);
+    stub_pid = start_stub(watch_rate, limit);
+
+    /* dwl-state exits with an error once the stub hangs up. */
+    run = timed_run(argv, NULL, NULL, 0);
+
+    stop(stub_pid);
+    stub_pid = 0;
+
+    printf("%-8s %-8s %10s %10s %10s %10s %12.0f %10ld\n", "watch", "all",
+           "-", "-", "-", "-", watch_events / (run.cpu_us / 1e6), run.maxrss_kb);
+    printf("# watch: %ld events in %.0f ms, %.0f ms of cpu\n",
+           watch_events, run.wall_us / 1e3, run.cpu_us / 1e3);
+}
+
+int main(int argc, char *argv[]) {
+    char daemon_socket[sizeof(runtime_dir) + 64];
+    const char *daemon_argv[] = { NULL, "-d", NULL };
+    pid_t daemon_pid;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:o:t:l:e:r:s:S:B:O")) != -1) {
+        switch (opt) {
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            case 'o':
+                outputs = optarg;
+                break;
+            case 't':
+                tags = optarg;
+                break;
+            case 'l':
+                layouts = optarg;
+                break;
+            case 'e':
+                watch_events = atol(optarg);
+                break;
+            case 'r':
+                watch_rate = optarg;
+                break;
+            case 's':
+                dwl_state = optarg;
+                break;
+            case 'S':
+                dwl_stub = optarg;
+                break;
+            case 'B':
+                budget_us = atof(optarg);
+                break;
+            case 'O':
+                oneshot_only = 1;
+                break;
+            default:
+                printf("Usage: %s [-n runs] [-o outputs] [-t tags] [-l layouts] [-e watch events] [-r watch rate] [-s dwl-state] [-S dwl-stub] [-B budget us] [-O]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (runs < 1 || watch_events < 1)
+        die("Need at least one run and one event");
+
+    /* Print every row as soon as it is done, runs take a while. */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (!mkdtemp(runtime_dir))
+        die("Could not create %s", runtime_dir);
+    setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+    setenv("WAYLAND_DISPLAY", SOCKET, 1);
+    snprintf(socket_file, sizeof(socket_file), "%s/%s", runtime_dir, SOCKET);
+    snprintf(daemon_socket, sizeof(daemon_socket), "%s/dwl-state-%s.sock", runtime_dir, SOCKET);
+
+    stub_pid = start_stub("0", "0");
+
+    printf("# %s outputs, %s tags, %s layouts, %d runs per query\n", outputs, tags, layouts, runs);
+    printf("%-8s %-8s %10s %10s %10s %10s %12s %10s\n",
+           "mode", "query", "p50 us", "p90 us", "p99 us", "max us", "events/s", "rss KiB");
+
+    bench_queries("oneshot", NULL, 1);
+    if (oneshot_only)
+        goto done;
+
+    daemon_argv[0] = dwl_state;
+    daemon_pid = spawn(daemon_argv, NULL, NULL, NULL);
+    wait_for(daemon_socket);
+    check_daemon();
+    bench_queries("daemon", NULL, 0);
+    bench_queries("shm", "--shm", 0);
+    stop(daemon_pid);
+
+    bench_batch(&queries[0]);
+    bench_watch();
+
+done:
+    if (stub_pid)
+        stop(stub_pid);
+    rmdir(runtime_dir);
+    return over_budget ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,360 @@
+/*
+ * A stand-in for dwl that implements just enough of a compositor for
+ * dwl-state: wl_output, zxdg_output_manager_v1 and the dwl-ipc protocol.
+ * It sends the state of every output like dwl's printstatus, and can
+ * generate updates at a fixed rate to benchmark dwl-state without dwl.
+ */
+#include <getopt.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wayland-server-core.h>
+#include <wayland-server-protocol.h>
+#include <wayland-server.h>
+
+#include "dwl-ipc-unstable-v1-server-protocol.h"
+#include "xdg-output-unstable-v1-server-protocol.h"
+
+#define MAX_OUTPUTS 64
+#define MAX_TAGS 256 /* Like DWL_STATE_TAGS_MAX. */
+#define IPC_TAGS 32 /* Tag masks of requests are 32 bits wide, the tag events have an index. */
+#define TAG_WORDS (MAX_TAGS / 64)
+#define TICK_MS 1
+
+/* Structures */
+struct Output {
+    int index;
+    char name[32];
+    char title[64];
+    uint64_t tagset[TAG_WORDS];
+    uint32_t layout;
+    uint32_t clients[MAX_TAGS];
+    struct wl_list dwl_outputs; /* zdwl_ipc_output_v1 resources */
+};
+
+/* Functions */
+static void die(const char *fmt, ...);
+static void dwl_manager_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id);
+static void dwl_manager_get_output(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *output);
+static void dwl_output_send(struct Output *output, struct wl_resource *resource);
+static void dwl_output_set_client_tags(struct wl_client *client, struct wl_resource *resource, uint32_t and_tags, uint32_t xor_tags);
+static void dwl_output_set_layout(struct wl_client *client, struct wl_resource *resource, uint32_t index);
+static void dwl_output_set_tags(struct wl_client *client, struct wl_resource *resource, uint32_t tagmask, uint32_t toggle_tagset);
+static int  handle_signal(int sig, void *data);
+static int  handle_tick(void *data);
+static int  tag_active(const struct Output *output, int tag);
+static void output_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id);
+static void printstatus(void);
+static void resource_destroy(struct wl_client *client, struct wl_resource *resource);
+static void resource_unlink(struct wl_resource *resource);
+static void xdg_manager_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id);
+static void xdg_manager_get_xdg_output(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *output_resource);
+
+/* Variables */
+static struct wl_display *display;
+static struct Output outputs[MAX_OUTPUTS];
+static int output_amount = 2,
+           tag_amount = 9,
+           layout_amount = 3,
+           rate = 0;
+static long event_limit = 0,
+            events = 0;
+static double pending = 0;
+static struct wl_event_source *timer;
+static int dwl_outputs_bound = 0;
+
+static const char *layout_names[] = { "[]=", "><>", "[M]", "TTT", "|M|", "[D]", "HHH", "###" };
+
+/* Implementations */
+static const struct zdwl_ipc_manager_v1_interface dwl_manager_implementation = {
+    .release = resource_destroy,
+    .get_output = dwl_manager_get_output,
+};
+
+static const struct zdwl_ipc_output_v1_interface dwl_output_implementation = {
+    .release = resource_destroy,
+    .set_layout = dwl_output_set_layout,
+    .set_tags = dwl_output_set_tags,
+    .set_client_tags = dwl_output_set_client_tags,
+};
+
+static const struct zxdg_output_manager_v1_interface xdg_manager_implementation = {
+    .destroy = resource_destroy,
+    .get_xdg_output = xdg_manager_get_xdg_output,
+};
+
+static const struct zxdg_output_v1_interface xdg_output_implementation = {
+    .destroy = resource_destroy,
+};
+
+static const struct wl_output_interface output_implementation = {
+    .release = resource_destroy,
+};
+
+void resource_destroy(struct wl_client *client, struct wl_resource *resource) {
+    wl_resource_destroy(resource);
+}
+
+void resource_unlink(struct wl_resource *resource) {
+    wl_list_remove(wl_resource_get_link(resource));
+}
+
+void output_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &wl_output_interface, version, id);
+    if (!resource) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(resource, &output_implementation, data, NULL);
+}
+
+void xdg_manager_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &zxdg_output_manager_v1_interface, version, id);
+    if (!resource) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(resource, &xdg_manager_implementation, NULL, NULL);
+}
+
+void xdg_manager_get_xdg_output(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *output_resource) {
+    struct Output *output = wl_resource_get_user_data(output_resource);
+    struct wl_resource *xdg_output = wl_resource_create(client, &zxdg_output_v1_interface,
+                                                        wl_resource_get_version(resource), id);
+    if (!xdg_output) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(xdg_output, &xdg_output_implementation, output, NULL);
+
+    /* Same order as wlroots. */
+    zxdg_output_v1_send_logical_position(xdg_output, output->index * 1920, 0);
+    zxdg_output_v1_send_logical_size(xdg_output, 1920, 1080);
+    if (wl_resource_get_version(xdg_output) >= 2) {
+        zxdg_output_v1_send_name(xdg_output, output->name);
+        zxdg_output_v1_send_description(xdg_output, "dwl-stub output");
+    }
+    zxdg_output_v1_send_done(xdg_output);
+}
+
+void dwl_manager_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    char name[8];
+    struct wl_resource *resource = wl_resource_create(client, &zdwl_ipc_manager_v1_interface, version, id);
+    if (!resource) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(resource, &dwl_manager_implementation, NULL, NULL);
+
+    for (int i = 0; i < tag_amount; i++) {
+        snprintf(name, sizeof(name), "%d", i+1);
+        zdwl_ipc_manager_v1_send_tag(resource, name);
+    }
+
+    for (int i = 0; i < layout_amount; i++)
+        zdwl_ipc_manager_v1_send_layout(resource, layout_names[i % (sizeof(layout_names)/sizeof(*layout_names))]);
+}
+
+void dwl_manager_get_output(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *output_resource) {
+    struct Output *output = wl_resource_get_user_data(output_resource);
+    struct wl_resource *dwl_output = wl_resource_create(client, &zdwl_ipc_output_v1_interface,
+                                                        wl_resource_get_version(resource), id);
+    if (!dwl_output) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(dwl_output, &dwl_output_implementation, output, resource_unlink);
+    wl_list_insert(&output->dwl_outputs, wl_resource_get_link(dwl_output));
+    dwl_output_send(output, dwl_output);
+
+    /* Updates start once somebody listens, so none of them get lost. */
+    if (!dwl_outputs_bound++ && rate)
+        wl_event_source_timer_update(timer, TICK_MS);
+}
+
+int tag_active(const struct Output *output, int tag) {
+    return output->tagset[tag / 64] >> tag % 64 & 1;
+}
+
+void dwl_output_send(struct Output *output, struct wl_resource *resource) {
+    zdwl_ipc_output_v1_send_active(resource, output->index == 0);
+
+    for (int i = 0; i < tag_amount; i++) {
+        uint32_t state = tag_active(output, i) ? ZDWL_IPC_OUTPUT_V1_TAG_STATE_ACTIVE : ZDWL_IPC_OUTPUT_V1_TAG_STATE_NONE;
+        zdwl_ipc_output_v1_send_tag(resource, i, state, output->clients[i], output->clients[i] && tag_active(output, i));
+    }
+
+    zdwl_ipc_output_v1_send_layout(resource, output->layout);
+    zdwl_ipc_output_v1_send_title(resource, output->title);
+    if (wl_resource_get_version(resource) >= ZDWL_IPC_OUTPUT_V1_APPID_SINCE_VERSION)
+        zdwl_ipc_output_v1_send_appid(resource, "stub");
+    zdwl_ipc_output_v1_send_frame(resource);
+}
+
+/* Like dwl, send everything to every output on any change. */
+void printstatus(void) {
+    struct wl_resource *resource;
+
+    for (int i = 0; i < output_amount; i++) {
+        wl_resource_for_each(resource, &outputs[i].dwl_outputs) {
+            dwl_output_send(&outputs[i], resource);
+        }
+    }
+}
+
+void dwl_output_set_tags(struct wl_client *client, struct wl_resource *resource, uint32_t tagmask, uint32_t toggle_tagset) {
+    struct Output *output = wl_resource_get_user_data(resource);
+    uint32_t mask = tag_amount < IPC_TAGS ? tagmask & ((1u << tag_amount) - 1) : tagmask;
+    int unchanged = output->tagset[0] == mask;
+
+    /* The mask can only view the first 32 tags, any above them are left. */
+    for (int i = 1; i < TAG_WORDS; i++)
+        unchanged = unchanged && !output->tagset[i];
+    if (!mask || unchanged)
+        return;
+
+    memset(output->tagset, 0, sizeof(output->tagset));
+    output->tagset[0] = mask;
+    printstatus();
+}
+
+void dwl_output_set_layout(struct wl_client *client, struct wl_resource *resource, uint32_t index) {
+    struct Output *output = wl_resource_get_user_data(resource);
+
+    if (index >= layout_amount || index == output->layout)
+        return;
+
+    output->layout = index;
+    printstatus();
+}
+
+void dwl_output_set_client_tags(struct wl_client *client, struct wl_resource *resource, uint32_t and_tags, uint32_t xor_tags) {
+    printstatus();
+}
+
+/* A title change on the first output, and every so often a new client. */
+int handle_tick(void *data) {
+    int amount;
+
+    pending += rate * TICK_MS / 1000.0;
+    amount = pending;
+    pending -= amount;
+
+    while (amount-- > 0) {
+        struct Output *output = &outputs[0];
+
+        events++;
+        snprintf(output->title, sizeof(output->title), "stub title %ld", events);
+        if (events % 16 == 0)
+            output->clients[events / 16 % tag_amount]++;
+
+        printstatus();
+
+        if (event_limit && events >= event_limit) {
+            wl_display_terminate(display);
+            return 0;
+        }
+    }
+
+    wl_event_source_timer_update(timer, TICK_MS);
+    return 0;
+}
+
+int handle_signal(int sig, void *data) {
+    wl_display_terminate(display);
+    return 0;
+}
+
+void die(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+
+    fprintf(stderr, "error: ");
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *socket = "wayland-stub";
+    struct wl_event_loop *loop;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:o:t:l:r:c:")) != -1) {
+        switch (opt) {
+            case 's':
+                socket = optarg;
+                break;
+            case 'o':
+                output_amount = atoi(optarg);
+                break;
+            case 't':
+                tag_amount = atoi(optarg);
+                break;
+            case 'l':
+                layout_amount = atoi(optarg);
+                break;
+            case 'r':
+                rate = atoi(optarg);
+                break;
+            case 'c':
+                event_limit = atol(optarg);
+                break;
+            default:
+                printf("Usage: %s [-s socket] [-o outputs] [-t tags] [-l layouts] [-r events per second] [-c events before exiting]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (output_amount < 1 || output_amount > MAX_OUTPUTS)
+        die("Between 1 and %d outputs", MAX_OUTPUTS);
+    if (tag_amount < 1 || tag_amount > MAX_TAGS)
+        die("Between 1 and %d tags", MAX_TAGS);
+    if (layout_amount < 1)
+        die("At least one layout");
+
+    if (!(display = wl_display_create()))
+        die("Could not create display");
+    if (wl_display_add_socket(display, socket) == -1)
+        die("Could not add socket %s", socket);
+
+    for (int i = 0; i < output_amount; i++) {
+        struct Output *output = &outputs[i];
+        /* With more tags than a mask holds, the other outputs view the last one. */
+        int tag = i && tag_amount > IPC_TAGS ? tag_amount - 1 : 0;
+
+        output->index = i;
+        output->tagset[tag / 64] = (uint64_t)1 << tag % 64;
+        output->clients[tag] = 1;
+        snprintf(output->name, sizeof(output->name), "STUB-%d", i+1);
+        snprintf(output->title, sizeof(output->title), "stub title");
+        wl_list_init(&output->dwl_outputs);
+
+        wl_global_create(display, &wl_output_interface, 3, output, output_bind);
+    }
+
+    wl_global_create(display, &zxdg_output_manager_v1_interface, 3, NULL, xdg_manager_bind);
+    wl_global_create(display, &zdwl_ipc_manager_v1_interface, 2, NULL, dwl_manager_bind);
+
+    loop = wl_display_get_event_loop(display);
+    timer = wl_event_loop_add_timer(loop, handle_tick, NULL);
+    wl_event_loop_add_signal(loop, SIGINT, handle_signal, NULL);
+    wl_event_loop_add_signal(loop, SIGTERM, handle_signal, NULL);
+
+    wl_display_run(display);
+    wl_display_flush_clients(display);
+
+    wl_display_destroy_clients(display);
+    wl_display_destroy(display);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,81 @@
+/*
+ * A status line for the active output on top of libdwlstate, printed
+ * again whenever dwl changes it. Pipe it into a bar that reads lines:
+ *
+ *     examples/bar | lemonbar
+ *
+ * Active tags are in brackets, urgent ones are marked with a !, empty
+ * inactive tags are left out.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libdwlstate.h"
+
+#define ERROR -1
+
+/* Functions */
+static void changed(struct dwl_state *state, struct dwl_state_output *output, uint32_t changes, void *data);
+static void print_line(struct dwl_state *state);
+
+void changed(struct dwl_state *state, struct dwl_state_output *output, uint32_t changes, void *data) {
+    /* Only the active output is shown, an output that became active brings its frame along. */
+    if (output == dwl_state_active_output(state))
+        print_line(state);
+}
+
+void print_line(struct dwl_state *state) {
+    struct dwl_state_output *output = dwl_state_active_output(state);
+    const struct dwl_state_tag *tags;
+    const char *layout, *title;
+
+    if (!output) {
+        printf("\n");
+        fflush(stdout);
+        return;
+    }
+
+    tags = dwl_state_output_tags(output);
+    for (uint32_t i = 0; tags && i < dwl_state_tag_amount(state); i++) {
+        if (!tags[i].clients && !(tags[i].state & DWL_STATE_TAG_ACTIVE))
+            continue;
+        printf(tags[i].state & DWL_STATE_TAG_ACTIVE ? "[%s%s] " : "%s%s ",
+               dwl_state_tag_name(state, i), tags[i].state & DWL_STATE_TAG_URGENT ? "!" : "");
+    }
+
+    layout = dwl_state_layout_name(state, dwl_state_output_layout(output));
+    title = dwl_state_output_title(output);
+    printf("%s %s\n", layout ? layout : "", title ? title : "");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    struct dwl_state *state;
+    struct pollfd pollfd;
+    int ready;
+
+    if (!(state = dwl_state_connect(NULL))) {
+        fprintf(stderr, "error: Could not connect to dwl: %s\n", strerror(errno));
+        return 1;
+    }
+
+    print_line(state);
+    dwl_state_set_callback(state, changed, NULL);
+
+    pollfd = (struct pollfd){dwl_state_get_fd(state), POLLIN};
+    while ((ready = poll(&pollfd, 1, -1)) != ERROR || errno == EINTR) {
+        if (ready == ERROR)
+            continue;
+        if (pollfd.revents & POLLIN && dwl_state_dispatch(state) == ERROR)
+            break;
+        if (pollfd.revents & (POLLHUP | POLLERR))
+            break;
+    }
+
+    fprintf(stderr, "error: Lost connection to dwl\n");
+    dwl_state_disconnect(state);
+    return 1;
+}
@@ -0,0 +1,128 @@
+/*
+ * Layout of the state snapshot dwl-stated publishes in shared memory,
+ * and a reader for it. Include this header to read dwl's state without
+ * any syscall beyond the initial mmap.
+ *
+ *     struct dwl_state_shm *shm = dwl_state_shm_open(NULL);
+ *     static struct dwl_state_shm snapshot;
+ *     if (shm && dwl_state_shm_read(shm, &snapshot) == 0)
+ *         ...
+ *
+ * The snapshot is protected by a sequence lock, the sequence is odd while
+ * dwl-stated writes and goes up by two every time an output is framed.
+ *
+ * The snapshot holds at most DWL_STATE_SHM_OUTPUTS outputs and
+ * DWL_STATE_SHM_LAYOUTS layouts, the ones beyond are left out. Tags go up to
+ * 256 like in dwl-state. Names, titles and appids are cut to fit.
+ */
+#ifndef DWL_STATE_SHM_H
+#define DWL_STATE_SHM_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define DWL_STATE_SHM_MAGIC   0x73776c64 /* "dlws" */
+#define DWL_STATE_SHM_VERSION 2
+#define DWL_STATE_SHM_OUTPUTS 16
+#define DWL_STATE_SHM_TAGS    256
+#define DWL_STATE_SHM_LAYOUTS 16
+#define DWL_STATE_SHM_NAME    64
+#define DWL_STATE_SHM_TEXT    256
+/* Formatted with the basename of WAYLAND_DISPLAY. */
+#define DWL_STATE_SHM_PATH    "/dwl-state-%s"
+
+struct dwl_state_shm_tag {
+    uint32_t state; /* zdwl_ipc_output_v1_tag_state */
+    uint32_t clients;
+    uint32_t focused;
+};
+
+struct dwl_state_shm_output {
+    char name[DWL_STATE_SHM_NAME];
+    uint32_t active;
+    uint32_t layout; /* Index into layouts. */
+    char title[DWL_STATE_SHM_TEXT];
+    char appid[DWL_STATE_SHM_TEXT];
+    struct dwl_state_shm_tag tags[DWL_STATE_SHM_TAGS];
+};
+
+struct dwl_state_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sequence;
+
+    uint32_t output_amount;
+    uint32_t tag_amount;
+    uint32_t layout_amount;
+    char tags[DWL_STATE_SHM_TAGS][DWL_STATE_SHM_NAME];
+    char layouts[DWL_STATE_SHM_LAYOUTS][DWL_STATE_SHM_NAME];
+    struct dwl_state_shm_output outputs[DWL_STATE_SHM_OUTPUTS];
+};
+
+/* Map the snapshot of display, or of WAYLAND_DISPLAY if NULL. Returns NULL on failure. */
+static inline struct dwl_state_shm *dwl_state_shm_open(const char *display) {
+    char path[256];
+    struct dwl_state_shm *shm;
+    int fd;
+
+    if (!display && !(display = getenv("WAYLAND_DISPLAY")))
+        display = "wayland-0";
+    if (strrchr(display, '/'))
+        display = strrchr(display, '/') + 1;
+
+    if (snprintf(path, sizeof(path), DWL_STATE_SHM_PATH, display) >= (int)sizeof(path))
+        return NULL;
+
+    if ((fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0)) == -1)
+        return NULL;
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+
+    if (shm->magic != DWL_STATE_SHM_MAGIC || shm->version != DWL_STATE_SHM_VERSION) {
+        munmap(shm, sizeof(*shm));
+        return NULL;
+    }
+
+    return shm;
+}
+
+static inline void dwl_state_shm_close(struct dwl_state_shm *shm) {
+    munmap(shm, sizeof(*shm));
+}
+
+/* The sequence of the latest snapshot, cheap to poll for changes. */
+static inline uint32_t dwl_state_shm_sequence(const struct dwl_state_shm *shm) {
+    return __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+}
+
+/* Copy a consistent snapshot, retrying while it is written. Returns -1 after too many tries. */
+static inline int dwl_state_shm_read(const struct dwl_state_shm *shm, struct dwl_state_shm *snapshot) {
+    uint32_t begin, end;
+
+    for (int tries = 0; tries < 1000; tries++) {
+        begin = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+        if (begin & 1)
+            continue;
+
+        memcpy(snapshot, shm, sizeof(*snapshot));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        end = __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED);
+        if (begin == end) {
+            snapshot->sequence = begin;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+#endif
@@ -1,51 +1,162 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <time.h>
 #include <poll.h>
-#include <wayland-client-core.h>
-#include <wayland-client-protocol.h>
-#include <wayland-client.h>
+#include <unistd.h>
 #include <wayland-util.h>
 
-#include "dwl-ipc-unstable-v1-protocol.h"
-#include "xdg-output-unstable-v1-protocol.h"
+#include "dwl-state-shm.h"
+#include "libdwlstate.h"
 
 #define VERSION 1.0
 #define EQUAL 0
 #define ERROR -1
-#define POLLFDS 1
-#define WL_ARRAY_LENGHT(array, type) ((array)->size/sizeof(type))
-#define WL_ARRAY_AT(array, type, index) ((type)(array)->data+index)
-#define CHECK_VERB_COUNT if (count > 1) { \
-                            printf(" "); \
-                            count--; \
+#define POLLFDS 2 /* The throttle timer and the hooks, after the displays. */
+#define DAEMON_POLLFDS 4 /* display, listening socket, hooks and metrics, clients follow. */
+#define REQUEST_MAX 4096
+#define ARGS_MAX 64
+#define DISPLAYS_MAX 16
+#define EXIT_TIMEOUT 2 /* A display didn't answer before the --timeout. */
+#define TRIGGERS_MAX 64
+#define CONDITIONS_MAX 16
+#define MAX_TAGS DWL_STATE_TAGS_MAX
+#define TAG_WORDS (MAX_TAGS / 64)
+#define IPC_TAGS 32 /* Tag masks in the protocol are 32 bits wide. */
+#define CHUNK_SIZE 4096
+#define TEMPLATE_OPS 64
+#define LOG_MAGIC 0x72776c64 /* "dlwr" */
+#define LOG_VERSION 1
+#define LOG_SETUP_DONE 0xff /* Logged after the setup roundtrips, next to the events. */
+#define LOG_HEADER 9 /* Type, output and microseconds since the previous event. */
+/* Monitors of the outputs dwl framed, in the order dwl announced them, newest first. */
+#define FOR_EACH_MONITOR(monitor, context) \
+    for (struct dwl_state_output *output_ = dwl_state_output_next((context)->state, NULL); \
+         output_ && ((monitor) = dwl_state_output_get_data(output_)); \
+         output_ = dwl_state_output_next((context)->state, output_))
+#define CHECK_VERB_COUNT if (*count > 1) { \
+                            buffer_printf(&out, " "); \
+                            (*count)--; \
                          }
 
 /* Structures */
-struct Tag {
-    uint state; /* zdwl_ipc_output_v1_tag_state */
+/* One bit per tag, iterate with tagset_next(). */
+struct Tagset {
+    uint64_t words[TAG_WORDS];
+};
+
+/* State transitions that run a command, see --hook. */
+enum Hook {
+    Hook_Urgent,
+    Hook_Active,
+    Hook_Layout,
+    Hook_Occupied,
+    Hook_Amount,
+};
+
+/* What --wait can wait for. */
+enum Wait {
+    Wait_Urgent,
+    Wait_Occupied,
+    Wait_Clients,
+    Wait_Active,
+    Wait_Layout,
+    Wait_Appid,
+    Wait_Title,
+    Wait_Amount,
+};
+
+/* Fields that can be throttled in watch mode, see --throttle. */
+enum Throttle {
+    Throttle_Active,
+    Throttle_Tags,
+    Throttle_Layout,
+    Throttle_Title,
+    Throttle_Appid,
+    Throttle_Amount,
+};
+
+/* A tag summed over all outputs, see -g. */
+struct Tag_Total {
     uint client_amount;
-    uint is_focused;
+    uint urgent_outputs; /* Outputs it is urgent on. */
 };
 
+/* What dwl-state keeps about an output next to its dwl_state_output, see output_changed(). */
 struct Monitor {
-    char *xdg_name;
-    int32_t registry_name;
-    struct wl_list link;
-    struct wl_output *wl_output;
-    struct zdwl_ipc_output_v1 *dwl_output;
-    struct Tag *tags;
+    struct Context *context;
+    struct dwl_state_output *output;
+    const char *xdg_name; /* Interned by the library. */
+    struct Tagset active_tags;
+
+    int dirty;                    /* Verbs of the fields that changed since they were last printed. */
+    int *tag_dirty;               /* The same for every tag. */
+    struct Tagset dirty_tags;     /* Tags that changed since they were last printed. */
+
+    uint64_t printed_ns[Throttle_Amount]; /* When a change of the field was last printed. */
+    uint64_t due_ns;                      /* When the held back changes are printed, 0 if none are. */
+
+    uint64_t title_changes; /* For the metrics. */
+};
+
+/* A hook waiting for the frame of its output, or for a free job. */
+struct Trigger {
+    enum Hook hook;
+    struct Monitor *monitor;
+    int tag; /* ERROR if the hook isn't about a tag. */
+    int ready;
+};
 
-    int framed;
-    int active;
-    int layout_index;
-    char* title;
-    char* appid;
+/*
+ * A --wait compiled by parse_wait(), so that condition_holds() only compares
+ * fields. Tags need all of state and at least clients, a layout or appid is
+ * compared by the pointer that the state of each display interned.
+ */
+struct Condition {
+    enum Wait wait;
+    uint32_t state;
+    uint32_t clients;
+    const char *text;
+    const char *interned[DISPLAYS_MAX]; /* Per context, set by check_query(). */
+};
+
+/* A connection to a compositor and everything it told us, one per --display. */
+struct Context {
+    const char *name; /* NULL for WAYLAND_DISPLAY. */
+    struct dwl_state *state;
+    int timed_out; /* Didn't answer the syncs before the deadline. */
+    uint64_t setup_start;
+    struct Monitor *active_output; /* Kept by monitor_commit(). */
+    int framed_amount;             /* Monitors that got their first frame. */
+    int setup_done;
+
+    /* Totals over all outputs, kept up to date by totals_update(). */
+    struct Tag_Total *totals;
+    struct Tagset occupied_tags, /* Tags with clients on any output. */
+                  urgent_tags;   /* Tags urgent on any output. */
+    int occupied_amount;
+    struct Tagset totals_dirty;  /* Tags whose totals changed since they were last printed. */
+    int summary_dirty;           /* The same for the active output and occupied_amount. */
+
+    struct Monitor *waited_active; /* The active output when --wait started waiting. */
 };
 
 enum Noun {
@@ -56,6 +167,111 @@ enum Noun {
     Outputs       = 1 << 3,
     Active_Tag    = 1 << 4,
     Active_Output = 1 << 5,
+    Totals        = 1 << 6,
+};
+
+enum Action {
+    Action_Query,
+    Action_Usage,
+    Action_Version,
+    Action_Daemon,
+    Action_Error,
+};
+
+/* What a query needs from the compositor, see plan_query(). */
+enum Need {
+    Need_Manager = 0,      /* Tags and layouts, always bound. */
+    Need_Outputs = 1 << 1, /* Outputs and their names. */
+    Need_State   = 1 << 2, /* The dwl state of every output. */
+};
+
+enum Format {
+    Format_Text,
+    Format_Json,
+    Format_Nul,
+    Format_Tlv,
+};
+
+/* Fields of the structured formats, the values double as tlv types. */
+enum Field {
+    Field_End     = 0, /* Ends a record. */
+    Field_Output  = 1,
+    Field_Tag     = 2,
+    Field_Active  = 3,
+    Field_Urgent  = 4,
+    Field_Title   = 5,
+    Field_Appid   = 6,
+    Field_Layout  = 7,
+    Field_Focused = 8,
+    Field_Clients = 9,
+    Field_Outputs = 10,
+    Field_Tags    = 11,
+    Field_Layouts = 12,
+    Field_Display = 13,
+    Field_Occupied = 14,
+};
+
+/* Options without a short form. */
+enum Long_Option {
+    Option_Format = 256,
+    Option_Shm,
+    Option_Set_Tags,
+    Option_Set_Layout,
+    Option_Set_Client_Tags,
+    Option_Toggle_Client_Tags,
+    Option_Confirm,
+    Option_Stats,
+    Option_Template,
+    Option_Throttle,
+    Option_Record,
+    Option_Replay,
+    Option_Realtime,
+    Option_Display,
+    Option_Hook,
+    Option_Hook_Jobs,
+    Option_Metrics_File,
+    Option_Metrics_Listen,
+    Option_Timeout,
+    Option_Wait,
+};
+
+/* Requests sent to the outputs, see apply_controls(). */
+enum Control {
+    Control_None        = 0,
+    Control_Tags        = 1 << 1,
+    Control_Layout      = 1 << 2,
+    Control_Client_Tags = 1 << 3,
+};
+
+/* Timed phases, see --stats. */
+enum Phase {
+    Phase_Args,
+    Phase_Connect,
+    Phase_Setup,
+    Phase_Controls,
+    Phase_Daemon,
+    Phase_Shm,
+    Phase_Dispatch,
+    Phase_Output,
+    Phase_Write,
+    Phase_Amount,
+};
+
+/* Events received, by type, see event_received(). */
+enum Event {
+    Event_Global_Add        = DWL_STATE_EVENT_OUTPUT_ADD,
+    Event_Global_Remove     = DWL_STATE_EVENT_OUTPUT_REMOVE,
+    Event_Xdg_Name          = DWL_STATE_EVENT_OUTPUT_NAME,
+    Event_Manager_Tag       = DWL_STATE_EVENT_TAG_NAME,
+    Event_Manager_Layout    = DWL_STATE_EVENT_LAYOUT_NAME,
+    Event_Active            = DWL_STATE_EVENT_ACTIVE,
+    Event_Tag               = DWL_STATE_EVENT_TAG,
+    Event_Layout            = DWL_STATE_EVENT_LAYOUT,
+    Event_Title             = DWL_STATE_EVENT_TITLE,
+    Event_Appid             = DWL_STATE_EVENT_APPID,
+    Event_Toggle_Visibility = DWL_STATE_EVENT_TOGGLE_VISIBILITY,
+    Event_Frame             = DWL_STATE_EVENT_FRAME,
+    Event_Amount            = DWL_STATE_EVENT_DONE,
 };
 
 enum Verb {
@@ -76,196 +292,771 @@ enum Verb {
     Clients   = 1 << 8,
 };
 
+/* Parts of a --template, see template_compile(). */
+enum Op_Type {
+    Op_Text,
+    Op_Output,
+    Op_Active,
+    Op_Title,
+    Op_Appid,
+    Op_Layout,
+    Op_Tag_Focused,
+    Op_Tag_Clients,
+    Op_Tags_Active,
+    Op_Tags_Urgent,
+    Op_Tags_Occupied,
+    Op_Amount,
+};
+
+struct Buffer {
+    char *data;
+    size_t length,
+           size;
+};
+
+struct Op {
+    enum Op_Type type;
+    const char *text; /* Of Op_Text, points into the template. */
+    size_t length;
+};
+
+struct Template {
+    struct Op ops[TEMPLATE_OPS];
+    int length,
+        verbs,     /* Of the output fields it prints. */
+        tag_verbs; /* Of the tag fields it prints. */
+};
+
+struct Stats {
+    uint64_t phase_ns[Phase_Amount];
+    uint32_t phase_calls[Phase_Amount];
+    uint64_t events[Event_Amount];
+    uint64_t bytes_written,
+             writes;
+};
+
+struct Client {
+    int fd;
+    char request[REQUEST_MAX];
+    size_t request_length;
+    struct Buffer response;
+    size_t response_offset;
+    int metrics; /* Came in on the metrics socket, gets the page instead of an answer. */
+    struct wl_list link;
+};
+
 /* Functions */
+static int  apply_controls(void);
 static void cleanup(void);
-static void check_global(void* global, const char *msg);
+static int  batch_run(void);
+static void buffer_add(struct Buffer *buffer, const void *data, size_t length);
+static int  buffer_flush(struct Buffer *buffer, int fd);
+static void buffer_printf(struct Buffer *buffer, const char *fmt, ...);
 static int  check_for_framed(char *name);
 static int  check_for_multiple_verbs(int verbs);
+static int  check_query(void);
+static void client_cleanup(struct Client *client);
+static int  client_query(int argc, char *argv[]);
+static void client_read(struct Client *client);
+static void client_write(struct Client *client);
+static int  condition_holds(struct Monitor *monitor);
+static struct Context *condition_search(void);
+static void daemon_accept(int fd, int metrics);
+static void display_dispatch(struct Context *context, short revents);
+static void display_prepare(struct Context *context, struct pollfd *pollfd);
+static void daemon_query(struct Client *client);
+static void daemon_run(void);
+static int  deadline_timeout(void);
 static void die(const char* fmt, ...);
-static void dwl_manager_tag(void *data, struct zdwl_ipc_manager_v1 *zdwl_ipc_manager_v1, const char *name);
-static void dwl_manager_layout(void *data, struct zdwl_ipc_manager_v1 *zdwl_ipc_manager_v1, const char *name);
-static void dwl_output_active(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t active);
-static void dwl_output_frame(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1);
-static void dwl_output_layout(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t layout);
-static void dwl_output_tag(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t index, uint32_t state, uint32_t clients, uint32_t focused);
-static void dwl_output_title(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, const char *title);
-static void dwl_output_appid(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, const char *appid);
-static void dwl_output_toggle_visibility(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1) {/* Do Nothing */}
+static const char *context_name(void);
+static void display_label(void);
+static const char *display_name(void);
 static void *ecalloc(size_t amount, size_t size);
-static struct Monitor *get_monitor_from_name(char *name);
-static void global_add(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version);
-static void global_remove(void *data, struct wl_registry *registry, uint32_t name);
+static void event_received(struct dwl_state *state, const struct dwl_state_event *event, void *data);
+static void *erealloc(void *ptr, size_t size);
+static int  fail(const char *fmt, ...);
+static struct Monitor *get_monitor_from_name(const char *name);
+static const struct dwl_state_tag *get_monitor_tags(struct Monitor *monitor);
+static uint64_t now_ns(void);
+static void hook_ready(struct Monitor *monitor);
+static void hook_reap(void);
+static void hook_run(void);
+static void hook_setup(void);
+static void hook_spawn(struct Trigger *trigger);
+static void hook_trigger(enum Hook hook, struct Monitor *monitor, int tag);
+static void log_event(const struct dwl_state_event *event);
+static void log_flush(void);
+static void log_open(const char *path);
+static void metrics_family(struct Buffer *buffer, const char *name, const char *type, const char *help, int openmetrics);
+static void metrics_labels(struct Buffer *buffer, struct Context *context, struct Monitor *monitor);
+static void metrics_page(struct Buffer *buffer, int openmetrics);
+static void metrics_respond(struct Client *client);
+static void metrics_setup(void);
+static void metrics_string(struct Buffer *buffer, const char *string);
+static void metrics_write(void);
 static void monitor_cleanup(struct Monitor *monitor);
-static void monitor_setup(uint32_t registry_name, struct wl_output* output);
-static void monitor_output(struct Monitor *monitor, int tagmask);
+static void monitor_commit(struct Monitor *monitor, uint32_t changes);
+static struct Monitor *monitor_create(struct dwl_state_output *output);
+static void monitor_frame(struct Monitor *monitor);
+static void monitor_output(struct Monitor *monitor, int query, const struct Tagset *tagmask, int dirty_only);
+static void monitor_output_line(struct Monitor *monitor, int *count);
+static void monitor_tag_line(struct Monitor *monitor, int index, int *count);
+static void monitor_tags(struct Monitor *monitor);
+static int  parse_args(int argc, char *argv[]);
+static int  parse_tags(const char *list, uint32_t *mask);
+static int  parse_wait(const char *wait);
+static int  parse_hook(const char *hook);
+static int  parse_throttle(const char *list);
+static void output_changed(struct dwl_state *state, struct dwl_state_output *output, uint32_t changes, void *data);
+static int  plan_query(int action);
 static void setup(void);
-static void print_wl_array(struct wl_array *array);
-static void xdg_name(void* data, struct zxdg_output_v1* xdg_output, const char* name);
+static void setup_signals(void);
+static int  setup_timed_out(void);
+static int  setup_wait(void);
+static int  shm_load(void);
+static void shm_publish(void);
+static void shm_setup(void);
+static int  socket_path(char *buf, size_t size);
+static int  print_query(struct Monitor *framed);
+static int  print_state(struct Monitor *framed);
+static void print_names(enum Field field, const char **names, size_t amount);
+static void print_dwl_names(enum Field field);
+static void record_end(void);
+static void record_start(void);
+static void record_string(enum Field field, const char *value);
+static void record_uint(enum Field field, uint32_t value);
+static int  replay_run(void);
+static void run(void);
+static int  wait_run(void);
+static void sig_handler(int sig);
+static void stats_end(enum Phase phase, uint64_t start);
+static void tagset_add(struct Tagset *set, int tag);
+static void tagset_and(struct Tagset *set, const struct Tagset *other);
+static int  tagset_empty(const struct Tagset *set);
+static void tagset_fill(struct Tagset *set, int amount);
+static int  tagset_has(const struct Tagset *set, int tag);
+static int  tagset_next(const struct Tagset *set, int from);
+static void tagset_remove(struct Tagset *set, int tag);
+static void totals_output(int dirty_only);
+static void totals_tag_line(int index, int *count);
+static void totals_update(struct Context *context, int index, const struct dwl_state_tag *old, const struct dwl_state_tag *new);
+static void stats_print(void);
+static uint64_t stats_start(void);
+static void throttle_arm(void);
+static void throttle_expire(void);
+static int  throttle_hold(struct Monitor *monitor);
+static int  template_changed(struct Monitor *monitor);
+static int  template_compile(const char *string);
+static void template_output(struct Monitor *monitor);
+static int  template_print(struct Monitor *framed, int dirty_only);
+static void template_tags(const struct Tagset *set);
+static void usage(const char *name);
 
 /* Variables */
-static struct wl_display *display;
-static int display_fd;
-static struct zdwl_ipc_manager_v1* dwl_manager;
-static struct wl_list monitors;
+static struct Context *contexts,
+                      *ctx; /* The context whose events are dispatched. */
+static int context_amount;
+static const char *display_names[DISPLAYS_MAX];
+static int display_amount;
 static struct pollfd *pollfds;
-static struct zxdg_output_manager_v1* output_manager;
-static struct wl_array tags,
-                       layouts;
+static size_t pollfds_size;
 static int noun = 0,
            verb = 0;
+static struct Tagset tagmask;
+static const struct dwl_state_tag no_tags[MAX_TAGS]; /* Of outputs dwl sent no tags for. */
+static char *wanted_monitor = NULL;
+static volatile sig_atomic_t running = 0;
+static int watching = 0,
+           full_snapshots = 0,
+           print_layouts = 0,
+           plan = Need_Outputs | Need_State;
+static int format = Format_Text,
+           default_format = Format_Text,
+           batch = 0;
+static struct Buffer out;
+static struct Template *template,
+                       parsed_template,
+                       default_template;
+static int record_fields;
+static char error[256];
+static struct wl_list clients;
+static int listen_fd = ERROR;
+static struct sockaddr_un listen_addr;
+static struct dwl_state_shm *shm_state;
+static char shm_path[256];
+static int read_shm = 0;
+static int controls = Control_None,
+           confirm = 0;
+static uint32_t control_tags,
+                control_and_tags,
+                control_xor_tags,
+                control_layout;
+static char *control_layout_name;
+static uint64_t throttles[Throttle_Amount]; /* Minimum time between prints of a field. */
+static int throttling = 0,
+           throttle_fd = ERROR;
+static const char *record_path,
+                  *replay_path;
+static int log_fd = ERROR,
+           realtime = 0;
+static uint64_t log_start_ns,
+                log_last_us;
+static struct Buffer event_log;
+static const char *hooks[Hook_Amount],        /* The commands, NULL without one. */
+                  *hook_commands[Hook_Amount]; /* Of the arguments parsed last, see main(). */
+static struct Trigger triggers[TRIGGERS_MAX];
+static int trigger_amount = 0,
+           hooked = 0,
+           hook_jobs = 4,
+           hooks_running = 0,
+           hook_fd = ERROR;
+static const char *metrics_file,    /* Of the arguments parsed last, see main(). */
+                  *metrics_address, /* A path or a port on localhost, served by the daemon. */
+                  *metrics_path;    /* Rewritten on every frame. */
+static int metering = 0,
+           metrics_fd = ERROR;
+static struct sockaddr_un metrics_addr;
+static uint64_t emit_ns, /* How long the frames took to publish and print. */
+                emits;
+static struct Buffer metrics_buffer;
+static int timeout_ms = 0;
+static struct Condition conditions[CONDITIONS_MAX];
+static int condition_amount = 0;
+static struct Context *waited; /* The display the --wait conditions held on first. */
+static uint64_t deadline_ns = 0; /* From --timeout, 0 without one. */
+static int show_stats = 0,
+           stats_requested = 0;
+static struct Stats stats;
 
 /* Listeners */
-static const struct zdwl_ipc_manager_v1_listener dwl_manager_listener = {
-    .tag = dwl_manager_tag,
-    .layout = dwl_manager_layout,
+static const struct option long_options[] = {
+    { "format", required_argument, NULL, Option_Format },
+    { "shm",    no_argument,       NULL, Option_Shm },
+    { "set-tags",           required_argument, NULL, Option_Set_Tags },
+    { "set-layout",         required_argument, NULL, Option_Set_Layout },
+    { "set-client-tags",    required_argument, NULL, Option_Set_Client_Tags },
+    { "toggle-client-tags", required_argument, NULL, Option_Toggle_Client_Tags },
+    { "confirm",            no_argument,       NULL, Option_Confirm },
+    { "stats",              no_argument,       NULL, Option_Stats },
+    { "template",           required_argument, NULL, Option_Template },
+    { "throttle",           required_argument, NULL, Option_Throttle },
+    { "record",             required_argument, NULL, Option_Record },
+    { "replay",             required_argument, NULL, Option_Replay },
+    { "realtime",           no_argument,       NULL, Option_Realtime },
+    { "display",            required_argument, NULL, Option_Display },
+    { "hook",               required_argument, NULL, Option_Hook },
+    { "hook-jobs",          required_argument, NULL, Option_Hook_Jobs },
+    { "metrics-file",       required_argument, NULL, Option_Metrics_File },
+    { "metrics-listen",     required_argument, NULL, Option_Metrics_Listen },
+    { "timeout",            required_argument, NULL, Option_Timeout },
+    { "wait",               required_argument, NULL, Option_Wait },
+    { 0 },
+};
+
+static const char *format_names[] = {
+    [Format_Text] = "text",
+    [Format_Json] = "json",
+    [Format_Nul]  = "nul",
+    [Format_Tlv]  = "tlv",
 };
 
-static const struct zdwl_ipc_output_v1_listener dwl_output_listener = {
-    .tag = dwl_output_tag,
-    .layout = dwl_output_layout,
-    .title = dwl_output_title,
-    .frame = dwl_output_frame,
-    .active = dwl_output_active,
-    .toggle_visibility = dwl_output_toggle_visibility,
-    .appid = dwl_output_appid,
+/* Keys of the fields in json. */
+static const char *field_names[] = {
+    [Field_Output]  = "output",
+    [Field_Tag]     = "tag",
+    [Field_Active]  = "active",
+    [Field_Urgent]  = "urgent",
+    [Field_Title]   = "title",
+    [Field_Appid]   = "appid",
+    [Field_Layout]  = "layout",
+    [Field_Focused] = "focused",
+    [Field_Clients] = "clients",
+    [Field_Outputs] = "outputs",
+    [Field_Tags]    = "tags",
+    [Field_Layouts] = "layouts",
+    [Field_Display] = "display",
+    [Field_Occupied] = "occupied",
 };
 
-static const struct wl_registry_listener registry_listener = {
-    .global = global_add,
-    .global_remove = global_remove,
+static const char *wait_names[] = {
+    [Wait_Urgent]   = "urgent",
+    [Wait_Occupied] = "occupied",
+    [Wait_Clients]  = "clients",
+    [Wait_Active]   = "active",
+    [Wait_Layout]   = "layout",
+    [Wait_Appid]    = "appid",
+    [Wait_Title]    = "title",
 };
 
-/* So that we can get the monitor names to match with dwl monitor names. */
-static const struct zxdg_output_v1_listener xdg_output_listener = {
-    .name = xdg_name,
+static const char *hook_names[] = {
+    [Hook_Urgent]   = "urgent",
+    [Hook_Active]   = "active",
+    [Hook_Layout]   = "layout",
+    [Hook_Occupied] = "occupied",
 };
 
-void dwl_output_appid(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, const char *appid) {
-    struct Monitor *monitor = data;
-    if (monitor->appid)
-        free(monitor->appid);
+/* Fields of --throttle, the verbs tell when they changed, tags have their own dirty set. */
+static const struct {
+    const char *name;
+    int verb;
+} throttle_fields[] = {
+    [Throttle_Active] = { "active", State },
+    [Throttle_Tags]   = { "tags",   0 },
+    [Throttle_Layout] = { "layout", Layout },
+    [Throttle_Title]  = { "title",  Title },
+    [Throttle_Appid]  = { "appid",  Appid },
+};
 
-    monitor->appid = strdup(appid);
-}
+/* Fields of --template, the verbs tell which changes show up in them. */
+static const struct {
+    const char *name;
+    int verbs,
+        tag_verbs;
+} placeholders[] = {
+    [Op_Output]        = { "output",        0,      0 },
+    [Op_Active]        = { "active",        State,  0 },
+    [Op_Title]         = { "title",         Title,  0 },
+    [Op_Appid]         = { "appid",         Appid,  0 },
+    [Op_Layout]        = { "layout",        Layout, 0 },
+    [Op_Tag_Focused]   = { "tag.focused",   0,      Focused },
+    [Op_Tag_Clients]   = { "tag.clients",   0,      Focused | Clients },
+    [Op_Tags_Active]   = { "tags.active",   0,      State },
+    [Op_Tags_Urgent]   = { "tags.urgent",   0,      State },
+    [Op_Tags_Occupied] = { "tags.occupied", 0,      Clients },
+};
 
-int get_active_tags(struct Monitor *monitor) {
-    int tagmask = 0;
-    for (int i = 0; i < WL_ARRAY_LENGHT(&tags, char**); i++) {
-        struct Tag *tag = &monitor->tags[i];
-        if (tag->state & ZDWL_IPC_OUTPUT_V1_TAG_STATE_ACTIVE)
-            tagmask |= 1 << i;
-    }
+static const char *phase_names[] = {
+    [Phase_Args]     = "arguments",
+    [Phase_Connect]  = "wl_display_connect",
+    [Phase_Setup]    = "setup roundtrips",
+    [Phase_Controls] = "controls",
+    [Phase_Daemon]   = "daemon query",
+    [Phase_Shm]      = "shm read",
+    [Phase_Dispatch] = "dispatch",
+    [Phase_Output]   = "output",
+    [Phase_Write]    = "write",
+};
 
-    return tagmask;
-}
+static const char *event_names[] = {
+    [Event_Global_Add]        = "global_add",
+    [Event_Global_Remove]     = "global_remove",
+    [Event_Xdg_Name]          = "xdg_name",
+    [Event_Manager_Tag]       = "dwl_manager_tag",
+    [Event_Manager_Layout]    = "dwl_manager_layout",
+    [Event_Active]            = "dwl_output_active",
+    [Event_Tag]               = "dwl_output_tag",
+    [Event_Layout]            = "dwl_output_layout",
+    [Event_Title]             = "dwl_output_title",
+    [Event_Appid]             = "dwl_output_appid",
+    [Event_Toggle_Visibility] = "dwl_output_toggle_visibility",
+    [Event_Frame]             = "dwl_output_frame",
+};
 
+/* The arguments of the logged events, a u for every number and an s for every string. */
+static const char *log_arguments[] = {
+    [Event_Global_Add]        = "",
+    [Event_Global_Remove]     = "",
+    [Event_Xdg_Name]          = "s",
+    [Event_Manager_Tag]       = "s",
+    [Event_Manager_Layout]    = "s",
+    [Event_Active]            = "u",
+    [Event_Tag]               = "uuuu",
+    [Event_Layout]            = "u",
+    [Event_Title]             = "s",
+    [Event_Appid]             = "s",
+    [Event_Toggle_Visibility] = "",
+    [Event_Frame]             = "",
+};
+
+/* Monitors only exist for framed outputs. */
 struct Monitor *get_active_monitor(void) {
-    struct Monitor *monitor;
-    wl_list_for_each(monitor, &monitors, link) {
-        if (monitor->active)
-            return monitor;
-    }
+    return ctx->active_output;
+}
 
-    return NULL;
+const struct dwl_state_tag *get_monitor_tags(struct Monitor *monitor) {
+    const struct dwl_state_tag *tags = dwl_state_output_tags(monitor->output);
+
+    return tags ? tags : no_tags;
 }
 
-void monitor_output(struct Monitor *monitor, int tagmask) {
-    int i;
+/*
+ * With dirty_only set, only lines with a field that changed since
+ * the last frame are printed.
+ */
+void monitor_output(struct Monitor *monitor, int query, const struct Tagset *tagmask, int dirty_only) {
+    struct Tagset wanted_tags = *tagmask;
     int count = check_for_multiple_verbs(verb);
+    int wanted = verb & Verb_All ? ~0 : verb;
 
     if (!verb)
         return;
 
-    if ((noun & Outputs || noun & Active_Output || noun & Noun_All) && (verb & State || verb & Appid || verb & Title || verb & Layout || verb & Verb_All)) {
-        if (!(verb & No_Labels))
-            printf("%s ", monitor->xdg_name);
+    if ((query & Outputs || query & Active_Output || query & Noun_All) && (verb & State || verb & Appid || verb & Title || verb & Layout || verb & Verb_All)
+            && (!dirty_only || monitor->dirty & wanted)) {
+        monitor_output_line(monitor, &count);
+    }
+
+    if (tagset_empty(&wanted_tags) && !(query & Active_Tag) && !(query & Tags) && !(query & Noun_All)) {
+        return;
+    }
+
+    if (!(verb & Focused || verb & Clients || verb & Verb_All || verb & State))
+        return;
 
-        if (verb & State || verb & Verb_All) {
-            printf("%s", monitor->active ? "Active" : "InActive");
-            CHECK_VERB_COUNT
-        }
+    if (query & Active_Tag)
+        wanted_tags = monitor->active_tags;
 
-        if (verb & Title || verb & Verb_All) {
-            printf("'%s'", monitor->title);
-            CHECK_VERB_COUNT
-        }
+    if (query & Noun_All || query & Tags)
+        tagset_fill(&wanted_tags, dwl_state_tag_amount(ctx->state));
 
-        if (verb & Appid || verb & Verb_All) {
-            printf("'%s'", monitor->appid);
-            CHECK_VERB_COUNT
+    if (dirty_only)
+        tagset_and(&wanted_tags, &monitor->dirty_tags);
+
+    for (int i = tagset_next(&wanted_tags, 0); i != ERROR; i = tagset_next(&wanted_tags, i + 1)) {
+        /* A tag that just became active is new to an active tag query. */
+        if (dirty_only && !(monitor->tag_dirty[i] & (query & Active_Tag ? wanted | State : wanted)))
+            continue;
+
+        monitor_tag_line(monitor, i, &count);
+    }
+}
+
+/*
+ * A line with the active output and the number of occupied tags, and with
+ * verbs a line per tag with the clients and state summed over all outputs.
+ */
+void totals_output(int dirty_only) {
+    struct Monitor *active_monitor = get_active_monitor();
+    struct Tagset wanted_tags = tagmask, all_tags;
+    int wanted = verb & ~No_Labels, count;
+
+    if ((!wanted || wanted & Verb_All) && (!dirty_only || ctx->summary_dirty)) {
+        if (format == Format_Text) {
+            display_label();
+            if (!(verb & No_Labels))
+                buffer_printf(&out, "all ");
+            buffer_printf(&out, "%s %d\n", active_monitor ? active_monitor->xdg_name : "-", ctx->occupied_amount);
+        } else {
+            record_start();
+            record_string(Field_Output, active_monitor ? active_monitor->xdg_name : NULL);
+            record_uint(Field_Occupied, ctx->occupied_amount);
+            record_end();
         }
+    }
+
+    if (!(wanted & State || wanted & Clients || wanted & Verb_All))
+        return;
+
+    tagset_fill(&all_tags, dwl_state_tag_amount(ctx->state));
+    if (tagset_empty(&wanted_tags))
+        wanted_tags = all_tags;
+    tagset_and(&wanted_tags, &all_tags);
+    if (dirty_only)
+        tagset_and(&wanted_tags, &ctx->totals_dirty);
+
+    count = check_for_multiple_verbs(verb & (State | Clients | Verb_All | No_Labels));
+    for (int i = tagset_next(&wanted_tags, 0); i != ERROR; i = tagset_next(&wanted_tags, i + 1))
+        totals_tag_line(i, &count);
+}
 
-        if (verb & Layout || verb & Verb_All) {
-            printf("%s", *WL_ARRAY_AT(&layouts, char**, monitor->layout_index));
-            CHECK_VERB_COUNT
+void totals_tag_line(int index, int *count) {
+    int occupied = tagset_has(&ctx->occupied_tags, index),
+        urgent = tagset_has(&ctx->urgent_tags, index);
+    uint clients = ctx->totals ? ctx->totals[index].client_amount : 0;
+
+    if (format != Format_Text) {
+        record_start();
+        record_uint(Field_Tag, index+1);
+        if (verb & State || verb & Verb_All) {
+            record_uint(Field_Occupied, occupied);
+            record_uint(Field_Urgent, urgent);
         }
+        if (verb & Clients || verb & Verb_All)
+            record_uint(Field_Clients, clients);
+        record_end();
+        return;
+    }
 
-        printf("\n");
+    display_label();
+    if (!(verb & No_Labels))
+        buffer_printf(&out, "all %d ", index+1);
+
+    if (verb & State || verb & Verb_All) {
+        buffer_printf(&out, "%s %s", occupied ? "Occupied" : "Empty", urgent ? "Urgent" : "");
+        CHECK_VERB_COUNT
+    }
+
+    if (verb & Clients || verb & Verb_All) {
+        buffer_printf(&out, "%u", clients);
+        CHECK_VERB_COUNT
     }
 
-    if (!tagmask && !(noun & Active_Tag) && !(noun & Tags) && !(noun & Noun_All)) {
+    buffer_printf(&out, "\n");
+}
+
+/* The verb count is shared by all lines of a monitor_output call. */
+void monitor_output_line(struct Monitor *monitor, int *count) {
+    struct dwl_state_output *output = monitor->output;
+    const char *layout = dwl_state_layout_name(ctx->state, dwl_state_output_layout(output));
+
+    if (format != Format_Text) {
+        record_start();
+        record_string(Field_Output, monitor->xdg_name);
+        if (verb & State || verb & Verb_All)
+            record_uint(Field_Active, dwl_state_output_active(output));
+        if (verb & Title || verb & Verb_All)
+            record_string(Field_Title, dwl_state_output_title(output));
+        if (verb & Appid || verb & Verb_All)
+            record_string(Field_Appid, dwl_state_output_appid(output));
+        if (verb & Layout || verb & Verb_All)
+            record_string(Field_Layout, layout);
+        record_end();
         return;
     }
 
-    if (noun & Active_Tag)
-        tagmask = get_active_tags(monitor);
+    display_label();
+    if (!(verb & No_Labels))
+        buffer_printf(&out, "%s ", monitor->xdg_name);
 
+    if (verb & State || verb & Verb_All) {
+        buffer_printf(&out, "%s", dwl_state_output_active(output) ? "Active" : "InActive");
+        CHECK_VERB_COUNT
+    }
 
-    if (noun & Noun_All || noun & Tags) {
-        tagmask = 0;
-        for (i = 0; i < WL_ARRAY_LENGHT(&tags, char**); i++)
-            tagmask |= 1 << i;
+    if (verb & Title || verb & Verb_All) {
+        buffer_printf(&out, "'%s'", dwl_state_output_title(output));
+        CHECK_VERB_COUNT
     }
 
-    for (i = 0; i < WL_ARRAY_LENGHT(&tags, char**); i++) {
-        if (!(tagmask & (1 << i)) || !(verb & Focused || verb & Clients || verb & Verb_All || verb & State))
-            continue;
+    if (verb & Appid || verb & Verb_All) {
+        buffer_printf(&out, "'%s'", dwl_state_output_appid(output));
+        CHECK_VERB_COUNT
+    }
+
+    if (verb & Layout || verb & Verb_All) {
+        buffer_printf(&out, "%s", layout);
+        CHECK_VERB_COUNT
+    }
 
-        if (!(verb & No_Labels))
-            printf("%s %d ", monitor->xdg_name, i+1);
+    buffer_printf(&out, "\n");
+}
 
-        struct Tag *tag = &monitor->tags[i];
+void monitor_tag_line(struct Monitor *monitor, int index, int *count) {
+    const struct dwl_state_tag *tag = &get_monitor_tags(monitor)[index];
 
+    if (format != Format_Text) {
+        record_start();
+        record_string(Field_Output, monitor->xdg_name);
+        record_uint(Field_Tag, index+1);
         if (verb & State || verb & Verb_All) {
-            printf("%s %s",
-                    tag->state & ZDWL_IPC_OUTPUT_V1_TAG_STATE_ACTIVE ? "Active" : "InActive",
-                    tag->state & ZDWL_IPC_OUTPUT_V1_TAG_STATE_URGENT ? "Urgent"  : "");
-            CHECK_VERB_COUNT
+            record_uint(Field_Active, !!(tag->state & DWL_STATE_TAG_ACTIVE));
+            record_uint(Field_Urgent, !!(tag->state & DWL_STATE_TAG_URGENT));
         }
+        if (verb & Focused || verb & Verb_All)
+            record_uint(Field_Focused, tag->focused);
+        if (verb & Clients || verb & Verb_All)
+            record_uint(Field_Clients, tag->clients);
+        record_end();
+        return;
+    }
 
-        if (verb & Focused || verb & Verb_All) {
-            printf("%d ", tag->is_focused);
-            CHECK_VERB_COUNT
-        }
+    display_label();
+    if (!(verb & No_Labels))
+        buffer_printf(&out, "%s %d ", monitor->xdg_name, index+1);
 
-        if (verb & Clients || verb & Verb_All) {
-            printf("%d", tag->client_amount);
-            CHECK_VERB_COUNT
-        }
+    if (verb & State || verb & Verb_All) {
+        buffer_printf(&out, "%s %s",
+                tag->state & DWL_STATE_TAG_ACTIVE ? "Active" : "InActive",
+                tag->state & DWL_STATE_TAG_URGENT ? "Urgent"  : "");
+        CHECK_VERB_COUNT
+    }
 
-        printf("\n");
+    if (verb & Focused || verb & Verb_All) {
+        buffer_printf(&out, "%d ", tag->focused);
+        CHECK_VERB_COUNT
     }
-    fflush(stdout);
-}
 
-int check_for_framed(char *name) {
-    int framed = 0;
-    struct Monitor *monitor;
+    if (verb & Clients || verb & Verb_All) {
+        buffer_printf(&out, "%d", tag->clients);
+        CHECK_VERB_COUNT
+    }
+
+    buffer_printf(&out, "\n");
+}
 
-    wl_list_for_each(monitor, &monitors, link) {
-        if (!name) { /* If no name check monitor */
-            if (!monitor->framed)
-                return 0;
-            framed = 1;
+/*
+ * Split the template into text and fields once, so that printing it
+ * is a walk over the ops. {{ and }} are literal braces.
+ */
+int template_compile(const char *string) {
+    struct Template *compiled = &parsed_template;
+    struct Op *op;
+    const char *end;
+    size_t length;
+
+    compiled->length = compiled->verbs = compiled->tag_verbs = 0;
+    if (!*string)
+        return fail("The template is empty");
+
+    while (*string) {
+        if (compiled->length == TEMPLATE_OPS)
+            return fail("The template has more than %d parts", TEMPLATE_OPS);
+        op = &compiled->ops[compiled->length++];
+
+        if (*string != '{' || string[1] == '{') {
+            op->type = Op_Text;
+            op->text = string;
+            if (*string == '{' || *string == '}') {
+                op->length = 1;
+                string += string[1] == *string ? 2 : 1;
+            } else {
+                op->length = strcspn(string, "{}");
+                string += op->length;
+            }
             continue;
         }
 
-        if (strcmp(monitor->xdg_name, name) == EQUAL && monitor->framed) {
+        if (!(end = strchr(string, '}')))
+            return fail("%s is missing a }", string);
+
+        length = end - string - 1;
+        for (op->type = Op_Output; op->type < Op_Amount; op->type++)
+            if (strlen(placeholders[op->type].name) == length && strncmp(placeholders[op->type].name, string + 1, length) == EQUAL)
+                break;
+
+        if (op->type == Op_Amount)
+            return fail("%.*s is not a valid field", (int)length + 2, string);
+
+        compiled->verbs |= placeholders[op->type].verbs;
+        compiled->tag_verbs |= placeholders[op->type].tag_verbs;
+        string = end + 1;
+    }
+
+    template = compiled;
+    return 0;
+}
+
+/* Whether a field of the template changed since the last frame. */
+int template_changed(struct Monitor *monitor) {
+    if (monitor->dirty & template->verbs)
+        return 1;
+
+    for (int i = tagset_next(&monitor->dirty_tags, 0); i != ERROR; i = tagset_next(&monitor->dirty_tags, i + 1))
+        if (monitor->tag_dirty[i] & template->tag_verbs)
             return 1;
+
+    return 0;
+}
+
+/* Tag numbers separated by commas. */
+void template_tags(const struct Tagset *set) {
+    const char *separator = "";
+
+    for (int i = tagset_next(set, 0); i != ERROR; i = tagset_next(set, i + 1)) {
+        buffer_printf(&out, "%s%d", separator, i+1);
+        separator = ",";
+    }
+}
+
+void template_output(struct Monitor *monitor) {
+    struct dwl_state_output *output = monitor->output;
+    const struct dwl_state_tag *tags = get_monitor_tags(monitor);
+    int tag_amount = dwl_state_tag_amount(ctx->state), focused = ERROR;
+    struct Tagset set;
+    const char *text;
+
+    for (int i = 0; i < tag_amount && focused == ERROR; i++)
+        if (tags[i].focused)
+            focused = i;
+
+    display_label();
+
+    for (struct Op *op = template->ops; op < template->ops + template->length; op++) {
+        switch (op->type) {
+            case Op_Text:
+                buffer_add(&out, op->text, op->length);
+                break;
+            case Op_Output:
+            case Op_Title:
+            case Op_Appid:
+            case Op_Layout:
+                if (op->type == Op_Output)
+                    text = monitor->xdg_name;
+                else if (op->type == Op_Title)
+                    text = dwl_state_output_title(output);
+                else if (op->type == Op_Appid)
+                    text = dwl_state_output_appid(output);
+                else
+                    text = dwl_state_layout_name(ctx->state, dwl_state_output_layout(output));
+                if (text)
+                    buffer_add(&out, text, strlen(text));
+                break;
+            case Op_Active:
+                buffer_printf(&out, "%d", dwl_state_output_active(output));
+                break;
+            case Op_Tag_Focused:
+                if (focused != ERROR)
+                    buffer_printf(&out, "%d", focused+1);
+                break;
+            case Op_Tag_Clients:
+                if (focused != ERROR)
+                    buffer_printf(&out, "%u", tags[focused].clients);
+                break;
+            case Op_Tags_Active:
+                template_tags(&monitor->active_tags);
+                break;
+            case Op_Tags_Urgent:
+            case Op_Tags_Occupied:
+                set = (struct Tagset){0};
+                for (int i = 0; i < tag_amount; i++) {
+                    if (op->type == Op_Tags_Urgent ? tags[i].state & DWL_STATE_TAG_URGENT : tags[i].clients > 0)
+                        tagset_add(&set, i);
+                }
+                template_tags(&set);
+                break;
+            case Op_Amount:
+                break;
+        }
+    }
+
+    buffer_add(&out, "\n", 1);
+}
+
+/*
+ * One line per output, the active one unless -o, -O or -E select others.
+ * With dirty_only set, outputs are only printed if a field of the template changed.
+ */
+int template_print(struct Monitor *framed, int dirty_only) {
+    struct Monitor *monitor;
+
+    if (wanted_monitor || noun & Outputs || noun & Noun_All) {
+        FOR_EACH_MONITOR(monitor, ctx) {
+            if ((framed && framed != monitor) || (dirty_only && !template_changed(monitor)))
+                continue;
+            if (wanted_monitor && strcmp(monitor->xdg_name, wanted_monitor) != EQUAL)
+                continue;
+
+            template_output(monitor);
         }
+        return 0;
     }
 
-    return framed;
+    if (!(monitor = get_active_monitor()))
+        return framed ? 0 : fail("There is no active output");
+
+    /* An output that just became active is new. */
+    if (!framed || (framed == monitor && (!dirty_only || monitor->dirty & State || template_changed(monitor))))
+        template_output(monitor);
+
+    return 0;
+}
+
+/* Whether the named monitor, or every monitor and at least one, got a frame. */
+int check_for_framed(char *name) {
+    if (name)
+        return !!get_monitor_from_name(name);
+
+    return ctx->framed_amount && ctx->framed_amount == dwl_state_output_amount(ctx->state);
 }
 
 int check_for_multiple_verbs(int verbs) {
@@ -277,195 +1068,1908 @@ int check_for_multiple_verbs(int verbs) {
             count++;
         verbs >>= 1;
     }
-    return count;
-}
+    return count;
+}
+
+/* The tag or layout names, as dwl sent them. */
+void print_dwl_names(enum Field field) {
+    uint32_t amount = field == Field_Tags ? dwl_state_tag_amount(ctx->state) : dwl_state_layout_amount(ctx->state);
+    const char *names[amount + 1];
+
+    for (uint32_t i = 0; i < amount; i++)
+        names[i] = field == Field_Tags ? dwl_state_tag_name(ctx->state, i) : dwl_state_layout_name(ctx->state, i);
+    print_names(field, names, amount);
+}
+
+void print_names(enum Field field, const char **names, size_t amount) {
+    if (format == Format_Text) {
+        display_label();
+        for (size_t i = 0; i < amount; i++)
+            buffer_printf(&out, "%s ", names[i]);
+        buffer_printf(&out, "\n");
+        return;
+    }
+
+    record_start();
+    if (format == Format_Json) {
+        buffer_printf(&out, "%s\"%s\":[", record_fields ? "," : "", field_names[field]);
+        for (size_t i = 0; i < amount; i++) {
+            record_fields = i; /* For the separator. */
+            record_string(Field_End, names[i]);
+        }
+        buffer_printf(&out, "]");
+    } else {
+        for (size_t i = 0; i < amount; i++)
+            record_string(field, names[i]);
+    }
+    record_end();
+}
+
+void record_start(void) {
+    record_fields = 0;
+    if (format == Format_Json)
+        buffer_printf(&out, "{");
+    if (context_amount > 1)
+        record_string(Field_Display, context_name());
+}
+
+/* With several displays, every line starts with the display it is about. */
+void display_label(void) {
+    if (context_amount > 1)
+        buffer_printf(&out, "%s ", context_name());
+}
+
+void record_end(void) {
+    switch (format) {
+        case Format_Json:
+            buffer_printf(&out, "}\n");
+            break;
+        case Format_Nul:
+            buffer_printf(&out, "\n");
+            break;
+        case Format_Tlv:
+            buffer_add(&out, (uint8_t[]){Field_End, 0, 0}, 3);
+            break;
+    }
+}
+
+/*
+ * Json escapes the value, nul terminates it and tlv prefixes it with the
+ * field and its length, both little endian. Field_End leaves out the json key.
+ */
+void record_string(enum Field field, const char *value) {
+    const unsigned char *c;
+    size_t length;
+
+    if (!value)
+        value = "";
+
+    switch (format) {
+        case Format_Json:
+            if (record_fields++)
+                buffer_printf(&out, ",");
+            if (field != Field_End)
+                buffer_printf(&out, "\"%s\":", field_names[field]);
+
+            buffer_printf(&out, "\"");
+            for (c = (const unsigned char*)value; *c; c++) {
+                if (*c == '"' || *c == '\\')
+                    buffer_printf(&out, "\\%c", *c);
+                else if (*c == '\n')
+                    buffer_printf(&out, "\\n");
+                else if (*c == '\t')
+                    buffer_printf(&out, "\\t");
+                else if (*c < 0x20 || *c == 0x7f)
+                    buffer_printf(&out, "\\u%04x", *c);
+                else
+                    buffer_add(&out, c, 1);
+            }
+            buffer_printf(&out, "\"");
+            break;
+        case Format_Nul:
+            buffer_add(&out, value, strlen(value) + 1);
+            break;
+        case Format_Tlv:
+            length = strlen(value);
+            if (length > UINT16_MAX)
+                length = UINT16_MAX;
+            buffer_add(&out, (uint8_t[]){field, length & 0xff, length >> 8}, 3);
+            buffer_add(&out, value, length);
+            break;
+    }
+}
+
+void record_uint(enum Field field, uint32_t value) {
+    switch (format) {
+        case Format_Json:
+            if (record_fields++)
+                buffer_printf(&out, ",");
+            buffer_printf(&out, "\"%s\":%u", field_names[field], value);
+            break;
+        case Format_Nul:
+            buffer_printf(&out, "%u", value);
+            buffer_add(&out, "", 1);
+            break;
+        case Format_Tlv:
+            buffer_add(&out, (uint8_t[]){field, 4, 0,
+                       value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24}, 7);
+            break;
+    }
+}
+
+void tagset_add(struct Tagset *set, int tag) {
+    set->words[tag / 64] |= (uint64_t)1 << (tag % 64);
+}
+
+void tagset_remove(struct Tagset *set, int tag) {
+    set->words[tag / 64] &= ~((uint64_t)1 << (tag % 64));
+}
+
+void tagset_and(struct Tagset *set, const struct Tagset *other) {
+    for (int i = 0; i < TAG_WORDS; i++)
+        set->words[i] &= other->words[i];
+}
+
+int tagset_empty(const struct Tagset *set) {
+    for (int i = 0; i < TAG_WORDS; i++)
+        if (set->words[i])
+            return 0;
+    return 1;
+}
+
+/* Set the first amount tags, and only those. */
+void tagset_fill(struct Tagset *set, int amount) {
+    for (int i = 0; i < TAG_WORDS; i++, amount -= 64)
+        set->words[i] = amount >= 64 ? ~(uint64_t)0 : amount > 0 ? ((uint64_t)1 << amount) - 1 : 0;
+}
+
+int tagset_has(const struct Tagset *set, int tag) {
+    return !!(set->words[tag / 64] & (uint64_t)1 << (tag % 64));
+}
+
+/* The first tag in set at or after from, or ERROR. */
+int tagset_next(const struct Tagset *set, int from) {
+    for (int i = from / 64; i < TAG_WORDS && from < MAX_TAGS; i++, from = i * 64) {
+        uint64_t word = set->words[i] >> (from % 64);
+        if (word)
+            return from + __builtin_ctzll(word);
+    }
+
+    return ERROR;
+}
+
+void buffer_add(struct Buffer *buffer, const void *data, size_t length) {
+    if (buffer->length + length > buffer->size) {
+        buffer->size = buffer->size ? buffer->size : BUFSIZ;
+        while (buffer->length + length > buffer->size)
+            buffer->size *= 2;
+        buffer->data = erealloc(buffer->data, buffer->size);
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+void buffer_printf(struct Buffer *buffer, const char *fmt, ...) {
+    va_list ap;
+    int length;
+
+    va_start(ap, fmt);
+    length = vsnprintf(buffer->data + buffer->length, buffer->size - buffer->length, fmt, ap);
+    va_end(ap);
+
+    if (length < 0)
+        return;
+
+    /* It didn't fit, grow the buffer and try again. */
+    if (buffer->length + length >= buffer->size) {
+        buffer->size = buffer->size ? buffer->size : BUFSIZ;
+        while (buffer->length + length >= buffer->size)
+            buffer->size *= 2;
+        buffer->data = erealloc(buffer->data, buffer->size);
+
+        va_start(ap, fmt);
+        vsnprintf(buffer->data + buffer->length, buffer->size - buffer->length, fmt, ap);
+        va_end(ap);
+    }
+
+    buffer->length += length;
+}
+
+/* Write out everything in one go and empty the buffer. */
+int buffer_flush(struct Buffer *buffer, int fd) {
+    uint64_t start = stats_start();
+    ssize_t n;
+
+    for (size_t offset = 0; offset < buffer->length; offset += n) {
+        if ((n = write(fd, buffer->data + offset, buffer->length - offset)) == ERROR) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            buffer->length = 0;
+            return ERROR;
+        }
+        stats.bytes_written += n;
+        stats.writes++;
+    }
+
+    buffer->length = 0;
+    stats_end(Phase_Write, start);
+    return 0;
+}
+
+/* The library indexes the outputs by name. */
+struct Monitor *get_monitor_from_name(const char *name) {
+    struct dwl_state_output *output = dwl_state_output_get(ctx->state, name);
+
+    return output ? dwl_state_output_get_data(output) : NULL;
+}
+
+/* Counts and logs every event of dwl, also those of a replay or snapshot. */
+void event_received(struct dwl_state *state, const struct dwl_state_event *event, void *data) {
+    struct Context *context = data;
+
+    if (event->type < Event_Amount)
+        stats.events[event->type]++;
+    if (event->type == DWL_STATE_EVENT_DONE && context->setup_start)
+        stats_end(Phase_Setup, context->setup_start);
+
+    log_event(event);
+    if (event->type == DWL_STATE_EVENT_FRAME || event->type == DWL_STATE_EVENT_OUTPUT_REMOVE
+            || event->type == DWL_STATE_EVENT_DONE)
+        log_flush();
+}
+
+/* A frame of an output, its Monitor is made on the first one and freed with the output. */
+void output_changed(struct dwl_state *state, struct dwl_state_output *output, uint32_t changes, void *data) {
+    struct Monitor *monitor;
+
+    ctx = data;
+    if (changes & DWL_STATE_OUTPUT_REMOVED) {
+        monitor = dwl_state_output_get_data(output);
+        if (monitor)
+            monitor_cleanup(monitor);
+        if (shm_state && ctx->setup_done)
+            shm_publish();
+        return;
+    }
+
+    monitor = changes & DWL_STATE_OUTPUT_ADDED ? monitor_create(output) : dwl_state_output_get_data(output);
+    monitor_commit(monitor, changes);
+    monitor_frame(monitor);
+}
+
+struct Monitor *monitor_create(struct dwl_state_output *output) {
+    struct Monitor *monitor = ecalloc(1, sizeof(*monitor));
+
+    monitor->context = ctx;
+    monitor->output = output;
+    monitor->xdg_name = dwl_state_output_name(output);
+    ctx->framed_amount++;
+    dwl_state_output_set_data(output, monitor);
+    return monitor;
+}
+
+/*
+ * Mark what the frame changed as dirty until it is printed, and trigger
+ * the hooks of it. The library already made the frame current.
+ */
+void monitor_commit(struct Monitor *monitor, uint32_t changes) {
+    struct dwl_state_output *output = monitor->output;
+    struct Context *context = monitor->context;
+    struct Monitor *active_output = context->active_output;
+    int tag_amount = dwl_state_tag_amount(context->state);
+    const struct dwl_state_tag *tags, *old_tags;
+
+    monitor_tags(monitor);
+    if (changes & DWL_STATE_CHANGED_ACTIVE) {
+        monitor->dirty |= State;
+        if (dwl_state_output_active(output))
+            hook_trigger(Hook_Active, monitor, ERROR);
+    }
+    if (changes & DWL_STATE_CHANGED_LAYOUT) {
+        monitor->dirty |= Layout;
+        hook_trigger(Hook_Layout, monitor, ERROR);
+    }
+    if (changes & DWL_STATE_CHANGED_TITLE) {
+        monitor->dirty |= Title;
+        monitor->title_changes++;
+    }
+    if (changes & DWL_STATE_CHANGED_APPID)
+        monitor->dirty |= Appid;
+
+    if (changes & DWL_STATE_CHANGED_TAGS) {
+        tags = dwl_state_output_tags(output);
+        old_tags = dwl_state_output_previous_tags(output);
+        for (int i = 0; i < tag_amount; i++) {
+            const struct dwl_state_tag *new = &tags[i], *old = old_tags ? &old_tags[i] : &(struct dwl_state_tag){0};
+            int dirty = (new->state != old->state ? State : 0) | (new->clients != old->clients ? Clients : 0)
+                      | (new->focused != old->focused ? Focused : 0);
+            if (!dirty)
+                continue;
+
+            monitor->tag_dirty[i] |= dirty;
+            tagset_add(&monitor->dirty_tags, i);
+            totals_update(context, i, old, new);
+            if (new->state & DWL_STATE_TAG_URGENT && !(old->state & DWL_STATE_TAG_URGENT))
+                hook_trigger(Hook_Urgent, monitor, i);
+            if (new->clients && !old->clients)
+                hook_trigger(Hook_Occupied, monitor, i);
+            if (new->state & DWL_STATE_TAG_ACTIVE)
+                tagset_add(&monitor->active_tags, i);
+            else
+                tagset_remove(&monitor->active_tags, i);
+        }
+    }
+
+    if (dwl_state_output_active(output))
+        context->active_output = monitor;
+    else if (context->active_output == monitor)
+        context->active_output = NULL;
+    if (context->active_output != active_output)
+        context->summary_dirty = 1;
+}
+
+/*
+ * Move a tag of one output from old to new in the totals, so that -g
+ * doesn't have to sum up every output for every query or frame.
+ */
+void totals_update(struct Context *context, int index, const struct dwl_state_tag *old, const struct dwl_state_tag *new) {
+    struct Tag_Total *total = &context->totals[index];
+    int was_urgent = !!(old->state & DWL_STATE_TAG_URGENT),
+        urgent = !!(new->state & DWL_STATE_TAG_URGENT);
+
+    if (old->clients == new->clients && was_urgent == urgent)
+        return;
+
+    if (old->clients != new->clients)
+        tagset_add(&context->totals_dirty, index);
+    total->client_amount += new->clients - old->clients;
+    total->urgent_outputs += urgent - was_urgent;
+
+    if (!total->client_amount != !tagset_has(&context->occupied_tags, index)) {
+        if (total->client_amount) {
+            tagset_add(&context->occupied_tags, index);
+            context->occupied_amount++;
+        } else {
+            tagset_remove(&context->occupied_tags, index);
+            context->occupied_amount--;
+        }
+        context->summary_dirty = 1;
+    }
+
+    if (!total->urgent_outputs != !tagset_has(&context->urgent_tags, index)) {
+        if (total->urgent_outputs)
+            tagset_add(&context->urgent_tags, index);
+        else
+            tagset_remove(&context->urgent_tags, index);
+        tagset_add(&context->totals_dirty, index);
+    }
+}
+
+/*
+ * Hold back a frame if every field that changed was printed less than its
+ * throttle ago, and arm the timer to print the latest state once the first
+ * of them is due. Otherwise the frame is printed and the fields stamped.
+ */
+int throttle_hold(struct Monitor *monitor) {
+    uint64_t now, due = 0;
+    int changes = 0;
+
+    if (!throttling)
+        return 0;
+
+    for (int i = 0; i < Throttle_Amount; i++) {
+        if (i == Throttle_Tags ? !tagset_empty(&monitor->dirty_tags) : monitor->dirty & throttle_fields[i].verb)
+            changes |= 1 << i;
+    }
+
+    now = now_ns();
+    for (int i = 0; i < Throttle_Amount && changes; i++) {
+        if (!(changes & 1 << i))
+            continue;
+
+        if (monitor->printed_ns[i] + throttles[i] <= now) {
+            due = 0;
+            break;
+        }
+        if (!due || monitor->printed_ns[i] + throttles[i] < due)
+            due = monitor->printed_ns[i] + throttles[i];
+    }
+
+    if (due) {
+        if (!monitor->due_ns || due < monitor->due_ns) {
+            monitor->due_ns = due;
+            throttle_arm();
+        }
+        return 1;
+    }
+
+    monitor->due_ns = 0;
+    for (int i = 0; i < Throttle_Amount; i++) {
+        if (changes & 1 << i)
+            monitor->printed_ns[i] = now;
+    }
+    return 0;
+}
+
+/* Arm the timer for the monitor that is due first, or disarm it. */
+void throttle_arm(void) {
+    struct itimerspec spec = {0};
+    struct Context *context;
+    struct Monitor *monitor;
+    uint64_t due = 0;
+
+    for (context = contexts; context < contexts + context_amount; context++) {
+        FOR_EACH_MONITOR(monitor, context) {
+            if (monitor->due_ns && (!due || monitor->due_ns < due))
+                due = monitor->due_ns;
+        }
+    }
+
+    spec.it_value.tv_sec = due / 1000000000;
+    spec.it_value.tv_nsec = due % 1000000000;
+    if (timerfd_settime(throttle_fd, TFD_TIMER_ABSTIME, &spec, NULL) == ERROR)
+        die("timerfd_settime:");
+}
+
+/* Print the held back changes of the monitors that are due. */
+void throttle_expire(void) {
+    struct Monitor *monitor;
+    uint64_t expirations, now = now_ns();
+
+    if (read(throttle_fd, &expirations, sizeof(expirations)) == ERROR && errno != EAGAIN)
+        die("read:");
+
+    for (ctx = contexts; ctx < contexts + context_amount; ctx++) {
+        FOR_EACH_MONITOR(monitor, ctx) {
+            if (monitor->due_ns && monitor->due_ns <= now) {
+                monitor->due_ns = 0;
+                monitor_frame(monitor);
+            }
+        }
+    }
+
+    throttle_arm();
+}
+
+/* Queue a hook, unless the same one is waiting already. Only changes after the setup count. */
+void hook_trigger(enum Hook hook, struct Monitor *monitor, int tag) {
+    if (!hooks[hook] || !monitor->context->setup_done)
+        return;
+
+    for (int i = 0; i < trigger_amount; i++) {
+        if (triggers[i].hook == hook && triggers[i].monitor == monitor && triggers[i].tag == tag)
+            return;
+    }
+
+    if (trigger_amount == TRIGGERS_MAX) {
+        fprintf(stderr, "error: Too many hooks waiting, dropped %s\n", hook_names[hook]);
+        return;
+    }
+
+    triggers[trigger_amount++] = (struct Trigger){hook, monitor, tag, 0};
+}
+
+/* The frame completes the state the hooks of the output see. */
+void hook_ready(struct Monitor *monitor) {
+    for (int i = 0; i < trigger_amount; i++) {
+        if (triggers[i].monitor == monitor)
+            triggers[i].ready = 1;
+    }
+
+    hook_run();
+}
+
+/* Start the ready hooks in order, as long as there are free jobs. */
+void hook_run(void) {
+    for (int i = 0; i < trigger_amount && hooks_running < hook_jobs;) {
+        if (!triggers[i].ready) {
+            i++;
+            continue;
+        }
+
+        hook_spawn(&triggers[i]);
+        memmove(&triggers[i], &triggers[i + 1], (--trigger_amount - i) * sizeof(*triggers));
+    }
+}
+
+/*
+ * Run the command with sh, the values are in the environment. The output
+ * goes to stderr, so that it doesn't mix with what -w prints.
+ */
+void hook_spawn(struct Trigger *trigger) {
+    struct Monitor *monitor = trigger->monitor;
+    const struct dwl_state_tag *tag = trigger->tag != ERROR ? &get_monitor_tags(monitor)[trigger->tag] : NULL;
+    const char *layout;
+    char *argv[] = { "/bin/sh", "-c", (char*)hooks[trigger->hook], NULL };
+    char values[7][256];
+    size_t amount = 0;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    pid_t pid;
+    int err;
+
+    while (environ[amount])
+        amount++;
+    char *envp[amount + sizeof(values)/sizeof(*values) + 1];
+    memcpy(envp, environ, amount * sizeof(*envp));
+
+    layout = dwl_state_layout_name(monitor->context->state, dwl_state_output_layout(monitor->output));
+    snprintf(values[0], sizeof(values[0]), "DWL_HOOK=%s", hook_names[trigger->hook]);
+    snprintf(values[1], sizeof(values[1]), "DWL_DISPLAY=%s", monitor->context->name ? monitor->context->name : display_name());
+    snprintf(values[2], sizeof(values[2]), "DWL_OUTPUT=%s", monitor->xdg_name ? monitor->xdg_name : "");
+    snprintf(values[3], sizeof(values[3]), "DWL_ACTIVE=%d", dwl_state_output_active(monitor->output));
+    snprintf(values[4], sizeof(values[4]), "DWL_LAYOUT=%s", layout ? layout : "");
+    snprintf(values[5], sizeof(values[5]), "DWL_TAG=%d", tag ? trigger->tag + 1 : 0);
+    snprintf(values[6], sizeof(values[6]), "DWL_CLIENTS=%u", tag ? tag->clients : 0);
+    for (size_t i = 0; i < sizeof(values)/sizeof(*values); i++)
+        envp[amount++] = values[i];
+    envp[amount] = NULL;
+
+    /* SIGCHLD is blocked for the signalfd, children get an empty mask. */
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+
+    err = posix_spawn(&pid, argv[0], &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err) {
+        fprintf(stderr, "error: Could not run the %s hook: %s\n", hook_names[trigger->hook], strerror(err));
+        return;
+    }
+    hooks_running++;
+}
+
+/* Finished hooks are reaped through a signalfd, so that they wake up poll. */
+void hook_setup(void) {
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == ERROR)
+        die("sigprocmask:");
+    if ((hook_fd = signalfd(ERROR, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == ERROR)
+        die("signalfd:");
+}
+
+void hook_reap(void) {
+    struct signalfd_siginfo info;
+
+    while (read(hook_fd, &info, sizeof(info)) == sizeof(info))
+        ;
+    while (waitpid(ERROR, NULL, WNOHANG) > 0)
+        hooks_running--;
+
+    hook_run();
+}
+
+/* The monitor has a name and a new state, publish and print it. */
+void monitor_frame(struct Monitor *monitor) {
+    uint64_t start = metering ? now_ns() : 0;
+
+    if (trigger_amount)
+        hook_ready(monitor);
+
+    if (shm_state && ctx->setup_done)
+        shm_publish();
+
+    if (condition_amount && ctx->setup_done && !waited && condition_holds(monitor)) {
+        waited = ctx;
+        running = 0;
+    }
+
+    /* The initial snapshot is printed once setup is done. */
+    if (watching && ctx->setup_done) {
+        /* Held back changes stay dirty until the timer prints them along with newer ones. */
+        if (throttle_hold(monitor))
+            return;
+
+        print_state(monitor);
+        if (buffer_flush(&out, STDOUT_FILENO) == ERROR)
+            die("write:");
+    }
+
+    if (metering && ctx->setup_done) {
+        emit_ns += now_ns() - start;
+        emits++;
+        if (metrics_path)
+            metrics_write();
+    }
+
+    monitor->dirty = 0;
+    for (int i = tagset_next(&monitor->dirty_tags, 0); i != ERROR; i = tagset_next(&monitor->dirty_tags, i + 1))
+        monitor->tag_dirty[i] = 0;
+    monitor->dirty_tags = (struct Tagset){0};
+    ctx->totals_dirty = (struct Tagset){0};
+    ctx->summary_dirty = 0;
+}
+
+/* Once dwl sent tags, the dirty bits and the totals are allocated. */
+void monitor_tags(struct Monitor *monitor) {
+    size_t tag_amount = dwl_state_tag_amount(monitor->context->state);
+
+    if (monitor->tag_dirty || !dwl_state_output_tags(monitor->output))
+        return;
+
+    monitor->tag_dirty = ecalloc(tag_amount, sizeof(*monitor->tag_dirty));
+    if (!monitor->context->totals)
+        monitor->context->totals = ecalloc(tag_amount, sizeof(*monitor->context->totals));
+}
+
+/* Free the monitor, the library frees its output right after. */
+void monitor_cleanup(struct Monitor *monitor) {
+    const struct dwl_state_tag *tags = dwl_state_output_tags(monitor->output);
+
+    monitor->context->framed_amount--;
+    for (int i = 0; i < trigger_amount;) {
+        if (triggers[i].monitor != monitor) {
+            i++;
+            continue;
+        }
+        memmove(&triggers[i], &triggers[i + 1], (--trigger_amount - i) * sizeof(*triggers));
+    }
+
+    if (monitor->context->active_output == monitor) {
+        monitor->context->active_output = NULL;
+        monitor->context->summary_dirty = 1;
+    }
+    if (monitor->context->waited_active == monitor)
+        monitor->context->waited_active = NULL;
+    for (int i = 0; tags && monitor->tag_dirty && i < (int)dwl_state_tag_amount(monitor->context->state); i++)
+        totals_update(monitor->context, i, &tags[i], &(struct dwl_state_tag){0});
+
+    dwl_state_output_set_data(monitor->output, NULL);
+    free(monitor->tag_dirty);
+    free(monitor);
+}
+
+/*
+ * Connect to every display and run the setup roundtrips of all of them
+ * in one poll loop, so that the slowest compositor bounds the setup.
+ */
+void setup(void) {
+    uint32_t flags = !(plan & Need_Outputs) ? DWL_STATE_NO_OUTPUTS
+                   : !(plan & Need_State) ? DWL_STATE_NO_OUTPUT_STATE : 0;
+    uint64_t start;
+
+    wl_list_init(&clients);
+
+    pollfds = ecalloc(context_amount + POLLFDS, sizeof(*pollfds));
+    pollfds_size = context_amount + POLLFDS;
+
+    for (ctx = contexts; ctx < contexts + context_amount; ctx++) {
+        start = stats_start();
+        ctx->state = dwl_state_new(ctx->name, flags);
+        if (!ctx->state)
+            die("Could not connect to wayland display %s", context_name());
+        stats_end(Phase_Connect, start);
+
+        ctx->setup_start = stats_start();
+        dwl_state_set_callback(ctx->state, output_changed, ctx);
+        dwl_state_set_event_hook(ctx->state, event_received, ctx);
+    }
+
+    setup_wait();
+
+    /* Frames that came along with the setup are part of the first snapshot, not printed on their own. */
+    for (ctx = contexts; ctx < contexts + context_amount; ctx++) {
+        if (!ctx->timed_out)
+            ctx->setup_done = 1;
+    }
+    ctx = contexts;
+
+    pollfds[context_amount] = (struct pollfd){throttle_fd, POLLIN};
+    pollfds[context_amount + 1] = (struct pollfd){hook_fd, POLLIN};
+}
+
+/*
+ * Dispatch the displays until their setup is done and all of their syncs
+ * are answered, or until the deadline of --timeout. Displays that missed
+ * it are marked timed out and left alone from then on, returns ERROR if
+ * there are any.
+ */
+int setup_wait(void) {
+    int pending, ready, timeout, status = 0;
+
+    for (;;) {
+        pending = 0;
+        for (int i = 0; i < context_amount; i++) {
+            pollfds[i] = (struct pollfd){ERROR};
+            if (contexts[i].timed_out || dwl_state_ready(contexts[i].state))
+                continue;
+
+            display_prepare(&contexts[i], &pollfds[i]);
+            pending++;
+        }
+
+        if (!pending)
+            return status;
+
+        timeout = deadline_timeout();
+        ready = timeout ? poll(pollfds, context_amount, timeout) : 0;
+        if (ready == ERROR && errno != EINTR)
+            die("poll:");
+
+        if (ready == 0) {
+            for (int i = 0; i < context_amount; i++) {
+                if (pollfds[i].fd != ERROR)
+                    contexts[i].timed_out = 1;
+            }
+            status = ERROR;
+            continue;
+        }
+
+        for (int i = 0; i < context_amount; i++) {
+            if (pollfds[i].fd != ERROR)
+                display_dispatch(&contexts[i], ready == ERROR ? 0 : pollfds[i].revents);
+        }
+    }
+}
+
+/* Milliseconds left until the --timeout for poll, -1 without one. */
+int deadline_timeout(void) {
+    uint64_t now;
+
+    if (!deadline_ns)
+        return -1;
+    if ((now = now_ns()) >= deadline_ns)
+        return 0;
+
+    /* Round up, poll would wake up before the deadline and spin. */
+    return (deadline_ns - now + 999999) / 1000000;
+}
+
+/* Tell which displays timed out, returns how many did. */
+int setup_timed_out(void) {
+    int amount = 0;
+
+    for (ctx = contexts; ctx < contexts + context_amount; ctx++) {
+        if (!ctx->timed_out)
+            continue;
+        fprintf(stderr, "error: %s didn't answer within %dms\n", context_name(), timeout_ms);
+        amount++;
+    }
+
+    ctx = contexts;
+    return amount;
+}
+
+/* Poll the display, requests that don't fit into the socket yet are flushed once it is writable. */
+void display_prepare(struct Context *context, struct pollfd *pollfd) {
+    ctx = context;
+    *pollfd = (struct pollfd){dwl_state_get_fd(context->state), POLLIN};
+    if (dwl_state_flush(context->state) == ERROR) {
+        if (errno != EAGAIN)
+            die("Lost connection to wayland display %s", context_name());
+        pollfd->events |= POLLOUT;
+    }
+}
+
+void display_dispatch(struct Context *context, short revents) {
+    ctx = context;
+    if (!(revents & POLLIN)) {
+        if (revents & (POLLHUP | POLLERR))
+            die("Lost connection to wayland display %s", context_name());
+        return;
+    }
+
+    if (dwl_state_dispatch(context->state) == ERROR) {
+        if (errno == EPROTONOSUPPORT)
+            die("%s lacks the dwl-ipc or xdg-output protocol", context_name());
+        if (errno == EPIPE || revents & (POLLHUP | POLLERR))
+            die("Lost connection to wayland display %s", context_name());
+        die("Could not dispatch wayland events of %s", context_name());
+    }
+}
+
+/* The display as given to --display, or as WAYLAND_DISPLAY names it. */
+const char *context_name(void) {
+    return ctx->name ? ctx->name : display_name();
+}
+
+/*
+ * Print the requested state. When framed is NULL a full snapshot is printed,
+ * otherwise only the part of the query that concerns the framed monitor.
+ */
+int print_state(struct Monitor *framed) {
+    uint64_t start = stats_start();
+    int status = print_query(framed);
+
+    stats_end(Phase_Output, start);
+    return status;
+}
+
+int print_query(struct Monitor *framed) {
+    int query = noun;
+    int dirty_only = framed && !full_snapshots;
+    const char *name = wanted_monitor;
+    struct Monitor *monitor, *active_monitor;
+
+    if (print_layouts && !framed)
+        print_dwl_names(Field_Layouts);
+
+    if (template)
+        return template_print(framed, dirty_only);
+
+    if (!query && !verb)
+        return 0;
+
+    /* Tags narrow down the totals, other nouns are printed along with them. */
+    if (query & Totals) {
+        totals_output(dirty_only);
+        query &= ~(Totals | Tags);
+        if (!query)
+            return 0;
+    }
+
+    if (query & Outputs && !verb) {
+        if (framed)
+            return 0;
+
+        const char *names[dwl_state_output_amount(ctx->state) + 1];
+        size_t amount = 0;
+        FOR_EACH_MONITOR(monitor, ctx) {
+            names[amount++] = monitor->xdg_name;
+        }
+        print_names(Field_Outputs, names, amount);
+        return 0;
+    }
+
+    if (query & Tags && !verb) {
+        if (!framed)
+            print_dwl_names(Field_Tags);
+        return 0;
+    }
+
+    active_monitor = get_active_monitor();
+    if (query & Active_Output && !verb && active_monitor && (!framed || framed == active_monitor)
+            && (!dirty_only || framed->dirty & State)) {
+        if (format == Format_Text) {
+            display_label();
+            buffer_printf(&out, "%s\n", active_monitor->xdg_name);
+        } else {
+            record_start();
+            record_string(Field_Output, active_monitor->xdg_name);
+            record_end();
+        }
+    }
+
+    if (query & Active_Tag && !verb && active_monitor && (!framed || framed == active_monitor)
+            && (!dirty_only || framed->dirty & State || !tagset_empty(&framed->dirty_tags))) {
+        const struct dwl_state_tag *tags = get_monitor_tags(active_monitor);
+        for (int i = 0; i < (int)dwl_state_tag_amount(ctx->state); i++) {
+            if (!tags[i].focused)
+                continue;
+
+            if (format == Format_Text) {
+                display_label();
+                buffer_printf(&out, "%s %d\n", active_monitor->xdg_name, i+1);
+            } else {
+                record_start();
+                record_string(Field_Output, active_monitor->xdg_name);
+                record_uint(Field_Tag, i+1);
+                record_end();
+            }
+        }
+    }
+
+    if ((query & Tags || query & Active_Tag) && !(verb & Focused || verb & Clients || verb & Verb_All))
+        return 0;
+
+    if ((query & Outputs || query & Active_Output) && !(verb & State || verb & Appid || verb & Title || verb & Layout || verb & Verb_All)) {
+        return 0;
+    }
+
+    if ((!(query & Tags) && !(query & Active_Tag)) && (verb & Focused || verb & Clients)) {
+        query |= Active_Tag;
+    }
+
+    if ((!(query & Outputs) && !name) || query & Active_Output) {
+        if (verb & State || verb & Appid || verb & Title || verb & Layout)
+            query |= Outputs;
+
+        if (!active_monitor)
+            return framed ? 0 : fail("There is no active output");
+        name = active_monitor->xdg_name;
+
+        /* Everything about an output that just became active is new. */
+        if (framed && framed->dirty & State)
+            dirty_only = 0;
+    }
+
+    if (query & Noun_All || (query & Outputs && !name)) {
+        if (framed) {
+            monitor_output(framed, query, &tagmask, dirty_only);
+        } else {
+            FOR_EACH_MONITOR(monitor, ctx) {
+                monitor_output(monitor, query, &tagmask, 0);
+            }
+        }
+    } else {
+        monitor = get_monitor_from_name(name);
+        if (monitor && (!framed || framed == monitor))
+            monitor_output(monitor, query, &tagmask, dirty_only);
+    }
+
+    return 0;
+}
+
+void log_open(const char *path) {
+    if ((log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == ERROR)
+        die("Could not open %s:", path);
+
+    buffer_add(&event_log, (uint8_t[]){LOG_MAGIC & 0xff, (LOG_MAGIC >> 8) & 0xff, (LOG_MAGIC >> 16) & 0xff, LOG_MAGIC >> 24,
+                                       LOG_VERSION}, 5);
+    log_start_ns = now_ns();
+    log_last_us = 0;
+}
+
+/*
+ * Append an event with the arguments log_arguments lists to the log, numbers
+ * are four bytes and strings have a two byte length, both little endian.
+ */
+void log_event(const struct dwl_state_event *event) {
+    int type = event->type == DWL_STATE_EVENT_DONE ? LOG_SETUP_DONE : event->type;
+    const char *arguments = type < Event_Amount ? log_arguments[type] : "";
+    uint64_t now_us;
+    uint32_t delta, value, id = event->output;
+    size_t length;
+    int k = 0;
+
+    if (log_fd == ERROR)
+        return;
+
+    now_us = (now_ns() - log_start_ns) / 1000;
+    delta = now_us - log_last_us > UINT32_MAX ? UINT32_MAX : now_us - log_last_us;
+    log_last_us = now_us;
+
+    buffer_add(&event_log, (uint8_t[]){type,
+               id & 0xff, (id >> 8) & 0xff, (id >> 16) & 0xff, id >> 24,
+               delta & 0xff, (delta >> 8) & 0xff, (delta >> 16) & 0xff, delta >> 24}, LOG_HEADER);
+
+    for (; *arguments; arguments++) {
+        if (*arguments == 'u') {
+            value = event->values[k++];
+            buffer_add(&event_log, (uint8_t[]){value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24}, 4);
+        } else {
+            length = event->string ? strlen(event->string) : 0;
+            if (length > UINT16_MAX)
+                length = UINT16_MAX;
+            buffer_add(&event_log, (uint8_t[]){length & 0xff, length >> 8}, 2);
+            buffer_add(&event_log, event->string, length);
+        }
+    }
+}
+
+/* Written on every frame, so a log is complete up to the last frame if we crash. */
+void log_flush(void) {
+    if (log_fd != ERROR && buffer_flush(&event_log, log_fd) == ERROR)
+        die("Could not write the log:");
+}
+
+/*
+ * Feed the events of a --record log to an offline state, without a
+ * compositor. The query is answered once the recorded setup is done,
+ * with -w the rest of the events are printed like dwl sent them.
+ */
+int replay_run(void) {
+    static char string[UINT16_MAX + 1];
+    struct Buffer log = {0};
+    const uint8_t *c, *end;
+    const char *arguments;
+    uint32_t id, delta, values[4];
+    uint64_t start;
+    char chunk[CHUNK_SIZE];
+    ssize_t n;
+    int fd, type, status = 0;
+
+    if ((fd = open(replay_path, O_RDONLY | O_CLOEXEC)) == ERROR)
+        return fail("Could not open %s: %s", replay_path, strerror(errno));
+    while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+        if (n == ERROR && errno != EINTR)
+            break;
+        if (n > 0)
+            buffer_add(&log, chunk, n);
+    }
+    close(fd);
+    if (n == ERROR) {
+        free(log.data);
+        return fail("Could not read %s: %s", replay_path, strerror(errno));
+    }
+
+    c = (const uint8_t*)log.data;
+    end = c + log.length;
+    if (log.length < 5 || (c[0] | c[1] << 8 | c[2] << 16 | (uint32_t)c[3] << 24) != LOG_MAGIC || c[4] != LOG_VERSION)
+        return fail("%s is not a dwl-state log", replay_path);
+    c += 5;
+
+    ctx->state = dwl_state_new(NULL, DWL_STATE_OFFLINE);
+    if (!ctx->state)
+        die("dwl_state_new:");
+    dwl_state_set_callback(ctx->state, output_changed, ctx);
+    dwl_state_set_event_hook(ctx->state, event_received, ctx);
+
+    start = stats_start();
+    while (c < end) {
+        if (end - c < LOG_HEADER || ((type = c[0]) >= Event_Amount && type != LOG_SETUP_DONE))
+            goto invalid;
+        id = c[1] | c[2] << 8 | c[3] << 16 | (uint32_t)c[4] << 24;
+        delta = c[5] | c[6] << 8 | c[7] << 16 | (uint32_t)c[8] << 24;
+        c += LOG_HEADER;
+
+        /* Nothing of the previous record is passed along. */
+        memset(values, 0, sizeof(values));
+        string[0] = '\0';
+        arguments = type < Event_Amount ? log_arguments[type] : "";
+        for (int i = 0; arguments[i]; i++) {
+            if (arguments[i] == 'u') {
+                if (end - c < 4)
+                    goto invalid;
+                values[i] = c[0] | c[1] << 8 | c[2] << 16 | (uint32_t)c[3] << 24;
+                c += 4;
+            } else {
+                if (end - c < 2 || end - c - 2 < (c[0] | c[1] << 8))
+                    goto invalid;
+                memcpy(string, c + 2, c[0] | c[1] << 8);
+                string[c[0] | c[1] << 8] = '\0';
+                c += 2 + (c[0] | c[1] << 8);
+            }
+        }
+
+        if (realtime && delta) {
+            if (buffer_flush(&out, STDOUT_FILENO) == ERROR)
+                die("write:");
+            nanosleep(&(struct timespec){delta / 1000000, delta % 1000000 * 1000}, NULL);
+        }
+
+        /* The library tells events of an output without the output apart. */
+        if (type != LOG_SETUP_DONE) {
+            if (dwl_state_feed(ctx->state, &(struct dwl_state_event){type, id,
+                               {values[0], values[1], values[2], values[3]}, string}) == ERROR)
+                goto feed_failed;
+            continue;
+        }
+
+        if (dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_DONE}) == ERROR)
+            goto feed_failed;
+        ctx->setup_done = 1;
+        if ((status = check_query()) == ERROR || (status = print_state(NULL)) == ERROR || !watching)
+            goto done;
+        if (buffer_flush(&out, STDOUT_FILENO) == ERROR)
+            die("write:");
+    }
+
+    if (!ctx->setup_done)
+        status = fail("%s ends before the setup was done", replay_path);
+    goto done;
+
+/* Only EINVAL is about the log, the library can run out of memory too. */
+feed_failed:
+    if (errno != EINVAL) {
+        status = fail("Could not replay %s: %s", replay_path, strerror(errno));
+        goto done;
+    }
+invalid:
+    status = fail("%s is not a valid dwl-state log", replay_path);
+done:
+    stats_end(Phase_Dispatch, start);
+    free(log.data);
+    return status == ERROR ? ERROR : 0;
+}
+
+void run(void) {
+    int ready;
+
+    setup_signals();
+
+    if (throttling) {
+        if ((throttle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == ERROR)
+            die("timerfd_create:");
+        pollfds[context_amount].fd = throttle_fd;
+    }
+
+    if (hooked) {
+        hook_setup();
+        pollfds[context_amount + 1].fd = hook_fd;
+    }
+
+    if (metrics_path)
+        metrics_write();
+
+    running = 1;
+    while (running) {
+        for (int i = 0; i < context_amount; i++)
+            display_prepare(&contexts[i], &pollfds[i]);
+
+        if ((ready = poll(pollfds, context_amount + POLLFDS, deadline_timeout())) == ERROR) {
+            if (errno != EINTR)
+                die("poll:");
+            continue;
+        }
+
+        for (int i = 0; i < context_amount; i++) {
+            uint64_t start = stats_start();
+            display_dispatch(&contexts[i], pollfds[i].revents);
+            if (pollfds[i].revents & POLLIN)
+                stats_end(Phase_Dispatch, start);
+        }
+
+        if (pollfds[context_amount].revents & POLLIN)
+            throttle_expire();
+
+        if (pollfds[context_amount + 1].revents & POLLIN)
+            hook_reap();
+
+        /* Only --wait keeps the deadline. */
+        if (!ready)
+            running = 0;
+    }
+}
+
+/*
+ * Wait for the --wait conditions to hold on an output the nouns select,
+ * checked on the state after the setup and then on every frame. Returns
+ * ERROR if the deadline or a signal came first.
+ */
+int wait_run(void) {
+    for (ctx = contexts; ctx < contexts + context_amount; ctx++)
+        ctx->waited_active = ctx->active_output;
+
+    if (!(waited = condition_search()))
+        run();
+
+    ctx = contexts;
+    return waited ? 0 : ERROR;
+}
+
+struct Context *condition_search(void) {
+    struct Monitor *monitor;
+
+    for (struct Context *context = contexts; context < contexts + context_amount; context++) {
+        if (context->timed_out)
+            continue;
+
+        FOR_EACH_MONITOR(monitor, context) {
+            if (condition_holds(monitor))
+                return context;
+        }
+    }
+
+    return NULL;
+}
+
+/* Whether all conditions hold on monitor, if the nouns select it. */
+int condition_holds(struct Monitor *monitor) {
+    struct dwl_state_output *output = monitor->output;
+    const struct dwl_state_tag *tags = get_monitor_tags(monitor);
+    struct Context *context = monitor->context;
+    struct Tagset wanted_tags = tagmask;
+    const char *text;
+    int found;
+
+    if ((wanted_monitor && strcmp(monitor->xdg_name, wanted_monitor) != EQUAL)
+            || (noun & Active_Output && context->active_output != monitor))
+        return 0;
+
+    if (noun & Active_Tag)
+        wanted_tags = monitor->active_tags;
+    else if (tagset_empty(&wanted_tags))
+        tagset_fill(&wanted_tags, dwl_state_tag_amount(context->state));
+
+    for (struct Condition *condition = conditions; condition < conditions + condition_amount; condition++) {
+        switch (condition->wait) {
+            case Wait_Urgent:
+            case Wait_Occupied:
+            case Wait_Clients:
+                found = 0;
+                for (int i = tagset_next(&wanted_tags, 0); i != ERROR && !found; i = tagset_next(&wanted_tags, i + 1)) {
+                    found = (tags[i].state & condition->state) == condition->state
+                         && tags[i].clients >= condition->clients;
+                }
+                if (!found)
+                    return 0;
+                break;
+            case Wait_Active:
+                /* Without an output, another output than the one that was active. */
+                if (!dwl_state_output_active(output) || (!wanted_monitor && monitor == context->waited_active))
+                    return 0;
+                break;
+            case Wait_Layout:
+            case Wait_Appid:
+                /* Before check_query() interned it nothing matches, wait_run() searches again. */
+                text = condition->wait == Wait_Layout ? dwl_state_layout_name(context->state, dwl_state_output_layout(output))
+                     : dwl_state_output_appid(output);
+                if (!text || text != condition->interned[context - contexts])
+                    return 0;
+                break;
+            case Wait_Title:
+                text = dwl_state_output_title(output);
+                if (!text || strcmp(text, condition->text) != EQUAL)
+                    return 0;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return 1;
+}
+
+void setup_signals(void) {
+    struct sigaction sa = {0};
+
+    sa.sa_handler = sig_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+void sig_handler(int sig) {
+    running = 0;
+}
+
+/* Tells the sockets and snapshots of different compositors apart. */
+const char *display_name(void) {
+    const char *name = getenv("WAYLAND_DISPLAY");
+
+    if (!name)
+        name = "wayland-0";
+    /* WAYLAND_DISPLAY may be an absolute path. */
+    if (strrchr(name, '/'))
+        name = strrchr(name, '/') + 1;
+
+    return name;
+}
+
+int socket_path(char *buf, size_t size) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    if (!dir)
+        return ERROR;
+
+    if (snprintf(buf, size, "%s/dwl-state-%s.sock", dir, display_name()) >= size)
+        return ERROR;
+
+    return 0;
+}
+
+void shm_setup(void) {
+    int fd;
+
+    snprintf(shm_path, sizeof(shm_path), DWL_STATE_SHM_PATH, display_name());
+
+    if ((fd = shm_open(shm_path, O_CREAT | O_RDWR | O_CLOEXEC, 0600)) == ERROR)
+        die("shm_open:");
+
+    if (ftruncate(fd, sizeof(*shm_state)) == ERROR) {
+        close(fd);
+        die("ftruncate:");
+    }
+
+    shm_state = mmap(NULL, sizeof(*shm_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm_state == MAP_FAILED) {
+        shm_state = NULL;
+        die("mmap:");
+    }
+
+    /* A previous dwl-stated may have left it mid write. */
+    if (shm_state->sequence & 1)
+        shm_state->sequence++;
+    shm_state->magic = DWL_STATE_SHM_MAGIC;
+    shm_state->version = DWL_STATE_SHM_VERSION;
+
+    shm_publish();
+}
+
+/* Copy the state into shared memory, see dwl-state-shm.h for the reader side. */
+void shm_publish(void) {
+    struct Monitor *monitor;
+    uint32_t i = 0, sequence = shm_state->sequence;
+    uint32_t tag_amount = dwl_state_tag_amount(ctx->state),
+             layout_amount = dwl_state_layout_amount(ctx->state);
+
+    if (tag_amount > DWL_STATE_SHM_TAGS)
+        tag_amount = DWL_STATE_SHM_TAGS;
+    if (layout_amount > DWL_STATE_SHM_LAYOUTS)
+        layout_amount = DWL_STATE_SHM_LAYOUTS;
+
+    __atomic_store_n(&shm_state->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    shm_state->tag_amount = tag_amount;
+    for (i = 0; i < tag_amount; i++)
+        snprintf(shm_state->tags[i], DWL_STATE_SHM_NAME, "%s", dwl_state_tag_name(ctx->state, i));
+
+    shm_state->layout_amount = layout_amount;
+    for (i = 0; i < layout_amount; i++)
+        snprintf(shm_state->layouts[i], DWL_STATE_SHM_NAME, "%s", dwl_state_layout_name(ctx->state, i));
+
+    i = 0;
+    FOR_EACH_MONITOR(monitor, ctx) {
+        struct dwl_state_shm_output *output = &shm_state->outputs[i];
+        const struct dwl_state_tag *tags = get_monitor_tags(monitor);
+        const char *title = dwl_state_output_title(monitor->output),
+                   *appid = dwl_state_output_appid(monitor->output);
+
+        if (i == DWL_STATE_SHM_OUTPUTS)
+            break;
+
+        snprintf(output->name, sizeof(output->name), "%s", monitor->xdg_name);
+        snprintf(output->title, sizeof(output->title), "%s", title ? title : "");
+        snprintf(output->appid, sizeof(output->appid), "%s", appid ? appid : "");
+        output->active = dwl_state_output_active(monitor->output);
+        output->layout = dwl_state_output_layout(monitor->output);
+        for (uint32_t j = 0; j < tag_amount; j++) {
+            output->tags[j].state = tags[j].state;
+            output->tags[j].clients = tags[j].clients;
+            output->tags[j].focused = tags[j].focused;
+        }
+        i++;
+    }
+    shm_state->output_amount = i;
+
+    __atomic_store_n(&shm_state->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* Build the state from the snapshot dwl-stated publishes, instead of asking dwl. */
+int shm_load(void) {
+    static struct dwl_state_shm snapshot;
+    uint64_t start = stats_start();
+    struct dwl_state_shm *mapped = dwl_state_shm_open(NULL);
+    uint32_t i, j;
+
+    if (!mapped)
+        return fail("Could not open the state snapshot, is dwl-stated running?");
+
+    if (dwl_state_shm_read(mapped, &snapshot) == ERROR) {
+        dwl_state_shm_close(mapped);
+        return fail("Could not read a consistent state snapshot");
+    }
+    dwl_state_shm_close(mapped);
+    stats_end(Phase_Shm, start);
+
+    ctx->state = dwl_state_new(NULL, DWL_STATE_OFFLINE);
+    if (!ctx->state)
+        die("dwl_state_new:");
+    dwl_state_set_callback(ctx->state, output_changed, ctx);
+    dwl_state_set_event_hook(ctx->state, event_received, ctx);
+
+    for (i = 0; i < snapshot.tag_amount && i < DWL_STATE_SHM_TAGS; i++) {
+        snapshot.tags[i][DWL_STATE_SHM_NAME-1] = '\0';
+        dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_TAG_NAME, .string = snapshot.tags[i]});
+    }
+
+    for (i = 0; i < snapshot.layout_amount && i < DWL_STATE_SHM_LAYOUTS; i++) {
+        snapshot.layouts[i][DWL_STATE_SHM_NAME-1] = '\0';
+        dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_LAYOUT_NAME, .string = snapshot.layouts[i]});
+    }
+
+    /* Outputs are listed newest first, go backwards to keep the order. */
+    for (i = snapshot.output_amount < DWL_STATE_SHM_OUTPUTS ? snapshot.output_amount : DWL_STATE_SHM_OUTPUTS; i-- > 0;) {
+        struct dwl_state_shm_output *output = &snapshot.outputs[i];
+        output->name[DWL_STATE_SHM_NAME-1] = '\0';
+        output->title[DWL_STATE_SHM_TEXT-1] = '\0';
+        output->appid[DWL_STATE_SHM_TEXT-1] = '\0';
+
+        /* Made up registry names, there is no registry. */
+        dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_OUTPUT_ADD, i + 1});
+        dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_OUTPUT_NAME, i + 1, .string = output->name});
+        for (j = 0; j < dwl_state_tag_amount(ctx->state); j++)
+            dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_TAG, i + 1,
+                           {j, output->tags[j].state, output->tags[j].clients, output->tags[j].focused}});
+        dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_ACTIVE, i + 1, {output->active}});
+        dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_LAYOUT, i + 1, {output->layout}});
+        dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_TITLE, i + 1, .string = output->title});
+        dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_APPID, i + 1, .string = output->appid});
+        dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_FRAME, i + 1});
+    }
+    dwl_state_feed(ctx->state, &(struct dwl_state_event){DWL_STATE_EVENT_DONE});
+
+    return 0;
+}
+
+/* Label values escape backslashes, quotes and newlines. */
+void metrics_string(struct Buffer *buffer, const char *string) {
+    for (size_t span; *string; string += span) {
+        span = strcspn(string, "\\\"\n");
+        buffer_add(buffer, string, span);
+        if (!string[span])
+            break;
+
+        buffer_add(buffer, "\\", 1);
+        buffer_add(buffer, string[span] == '\n' ? "n" : &string[span], 1);
+        span++;
+    }
+}
+
+void metrics_labels(struct Buffer *buffer, struct Context *context, struct Monitor *monitor) {
+    buffer_add(buffer, "{display=\"", 10);
+    metrics_string(buffer, context->name ? context->name : display_name());
+    if (monitor) {
+        buffer_add(buffer, "\",output=\"", 10);
+        metrics_string(buffer, monitor->xdg_name);
+    }
+    buffer_add(buffer, "\"", 1);
+}
+
+/*
+ * OpenMetrics names the family of a counter without _total, the text format
+ * of node_exporter's textfile collector expects the name of the samples.
+ */
+void metrics_family(struct Buffer *buffer, const char *name, const char *type, const char *help, int openmetrics) {
+    const char *suffix = !openmetrics && strcmp(type, "counter") == EQUAL ? "_total" : "";
+
+    buffer_printf(buffer, "# HELP %s%s %s\n# TYPE %s%s %s\n", name, suffix, help, name, suffix, type);
+}
+
+/* The state of every output and dwl-state's own counters. */
+void metrics_page(struct Buffer *buffer, int openmetrics) {
+    struct Context *context;
+    struct Monitor *monitor;
+
+    metrics_family(buffer, "dwl_outputs", "gauge", "Outputs dwl announced.", openmetrics);
+    for (context = contexts; context < contexts + context_amount; context++) {
+        buffer_add(buffer, "dwl_outputs", 11);
+        metrics_labels(buffer, context, NULL);
+        buffer_printf(buffer, "} %d\n", dwl_state_output_amount(context->state));
+    }
+
+    metrics_family(buffer, "dwl_output_active", "gauge", "1 for the active output.", openmetrics);
+    for (context = contexts; context < contexts + context_amount; context++) {
+        FOR_EACH_MONITOR(monitor, context) {
+            buffer_add(buffer, "dwl_output_active", 17);
+            metrics_labels(buffer, context, monitor);
+            buffer_printf(buffer, "} %d\n", dwl_state_output_active(monitor->output));
+        }
+    }
+
+    metrics_family(buffer, "dwl_output_layout", "gauge", "Index of the layout of the output, in the order of -L.", openmetrics);
+    for (context = contexts; context < contexts + context_amount; context++) {
+        FOR_EACH_MONITOR(monitor, context) {
+            buffer_add(buffer, "dwl_output_layout", 17);
+            metrics_labels(buffer, context, monitor);
+            buffer_printf(buffer, "} %u\n", dwl_state_output_layout(monitor->output));
+        }
+    }
+
+    metrics_family(buffer, "dwl_output_urgent_tags", "gauge", "Urgent tags of the output.", openmetrics);
+    for (context = contexts; context < contexts + context_amount; context++) {
+        FOR_EACH_MONITOR(monitor, context) {
+            const struct dwl_state_tag *tags = get_monitor_tags(monitor);
+            int urgent = 0;
+            for (size_t i = 0; i < dwl_state_tag_amount(context->state); i++)
+                urgent += !!(tags[i].state & DWL_STATE_TAG_URGENT);
+            buffer_add(buffer, "dwl_output_urgent_tags", 22);
+            metrics_labels(buffer, context, monitor);
+            buffer_printf(buffer, "} %d\n", urgent);
+        }
+    }
 
-void print_wl_array(struct wl_array *array) {
-    char** ptr;
-    wl_array_for_each(ptr, array) {
-        printf("%s ", *ptr);
+    metrics_family(buffer, "dwl_output_title_changes", "counter", "Times the title of the output changed.", openmetrics);
+    for (context = contexts; context < contexts + context_amount; context++) {
+        FOR_EACH_MONITOR(monitor, context) {
+            buffer_add(buffer, "dwl_output_title_changes_total", 30);
+            metrics_labels(buffer, context, monitor);
+            buffer_printf(buffer, "} %lu\n", (unsigned long)monitor->title_changes);
+        }
     }
-    printf("\n");
-    fflush(stdout);
-}
 
-struct Monitor *get_monitor_from_name(char *name) {
-    struct Monitor *monitor;
-    wl_list_for_each(monitor, &monitors, link) {
-        if (strcmp(monitor->xdg_name, name) == EQUAL)
-            return monitor;
+    metrics_family(buffer, "dwl_tag_clients", "gauge", "Clients on the tag.", openmetrics);
+    for (context = contexts; context < contexts + context_amount; context++) {
+        FOR_EACH_MONITOR(monitor, context) {
+            for (size_t i = 0; i < dwl_state_tag_amount(context->state); i++) {
+                buffer_add(buffer, "dwl_tag_clients", 15);
+                metrics_labels(buffer, context, monitor);
+                buffer_printf(buffer, ",tag=\"%zu\"} %u\n", i + 1, get_monitor_tags(monitor)[i].clients);
+            }
+        }
     }
 
-    return NULL;
-}
+    metrics_family(buffer, "dwl_state_events", "counter", "Events received from dwl.", openmetrics);
+    for (int i = 0; i < Event_Amount; i++)
+        buffer_printf(buffer, "dwl_state_events_total{event=\"%s\"} %lu\n", event_names[i], (unsigned long)stats.events[i]);
 
-void check_global(void *global, const char *msg) {
-    if (!global)
-        die(msg);
-}
+    metrics_family(buffer, "dwl_state_emit_seconds", "summary", "Time from a frame to its state being published and printed.", openmetrics);
+    buffer_printf(buffer, "dwl_state_emit_seconds_sum %.9f\ndwl_state_emit_seconds_count %lu\n", emit_ns / 1e9, (unsigned long)emits);
 
-void xdg_name(void* data, struct zxdg_output_v1* xdg_output, const char* name) {
-    struct Monitor *monitor = data;
-    monitor->xdg_name = strdup(name);
-    zxdg_output_v1_destroy(xdg_output);
-}
+    metrics_family(buffer, "dwl_state_written_bytes", "counter", "Bytes dwl-state wrote.", openmetrics);
+    buffer_printf(buffer, "dwl_state_written_bytes_total %lu\n", (unsigned long)stats.bytes_written);
 
-void dwl_output_active(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t active) {
-    struct Monitor* monitor = data;
-    monitor->active = active;
+    if (openmetrics)
+        buffer_add(buffer, "# EOF\n", 6);
 }
 
-void dwl_output_tag(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t index, uint32_t state, uint32_t clients, uint32_t focused) {
-    struct Monitor *monitor = data;
-    struct Tag *tag         = &monitor->tags[index];
+/* Written next to the file and renamed over it, so readers never see half of it. */
+void metrics_write(void) {
+    char path[PATH_MAX];
+    int fd;
 
-    tag->state = state;
-    tag->client_amount = clients;
-    tag->is_focused = focused;
-}
+    if (snprintf(path, sizeof(path), "%s.tmp", metrics_path) >= sizeof(path))
+        die("%s is too long", metrics_path);
 
-void dwl_output_layout(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t layout) {
-    struct Monitor *monitor = data;
-    monitor->layout_index=layout;
+    metrics_page(&metrics_buffer, 0);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == ERROR)
+        die("open %s:", path);
+    if (buffer_flush(&metrics_buffer, fd) == ERROR)
+        die("write %s:", path);
+    close(fd);
+
+    if (rename(path, metrics_path) == ERROR)
+        die("rename %s:", path);
 }
 
-void dwl_output_title(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, const char *title) {
-    struct Monitor *monitor = data;
-    if (monitor->title)
-        free(monitor->title);
+/* Listen on a unix socket, or on localhost if the address is a port. */
+void metrics_setup(void) {
+    int one = 1;
+
+    if (!metrics_address[strspn(metrics_address, "0123456789")]) {
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(atoi(metrics_address)),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+
+        if ((metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == ERROR)
+            die("socket:");
+        setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(metrics_fd, (struct sockaddr*)&addr, sizeof(addr)) == ERROR)
+            die("bind 127.0.0.1:%s:", metrics_address);
+    } else {
+        if (strlen(metrics_address) >= sizeof(metrics_addr.sun_path))
+            die("%s is too long", metrics_address);
+        metrics_addr.sun_family = AF_UNIX;
+        strcpy(metrics_addr.sun_path, metrics_address);
+        unlink(metrics_address);
+
+        if ((metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == ERROR)
+            die("socket:");
+        if (bind(metrics_fd, (struct sockaddr*)&metrics_addr, sizeof(metrics_addr)) == ERROR)
+            die("bind %s:", metrics_address);
+    }
 
-    monitor->title = strdup(title);
+    if (listen(metrics_fd, SOMAXCONN) == ERROR)
+        die("listen:");
 }
 
-void dwl_output_frame(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1) {
-    struct Monitor *monitor = data;
-    monitor->framed = 1;
+/* Any request gets the page, there is nothing else to serve. */
+void metrics_respond(struct Client *client) {
+    metrics_page(&metrics_buffer, 1);
+
+    buffer_printf(&client->response, "HTTP/1.0 200 OK\r\n"
+                                     "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                                     "Content-Length: %zu\r\n"
+                                     "Connection: close\r\n\r\n", metrics_buffer.length);
+    buffer_add(&client->response, metrics_buffer.data, metrics_buffer.length);
+    metrics_buffer.length = 0;
 }
 
-void dwl_manager_tag(void *data, struct zdwl_ipc_manager_v1 *zdwl_ipc_manager_v1, const char *name) {
-    char** ptr = wl_array_add(&tags, sizeof(char**));
-    if (!ptr)
-        return;
+/*
+ * Send the arguments to a running dwl-stated and print its answer.
+ * Returns ERROR if there is no daemon to ask, otherwise the query status.
+ */
+int client_query(int argc, char *argv[]) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char buf[REQUEST_MAX];
+    size_t length = 0;
+    ssize_t n;
+    int fd, status;
+
+    if (socket_path(addr.sun_path, sizeof(addr.sun_path)) == ERROR)
+        return ERROR;
+
+    for (int i = 1; i < argc; i++) {
+        size_t arg_length = strlen(argv[i]) + 1;
+        if (length + arg_length > sizeof(buf))
+            return ERROR;
+        memcpy(buf + length, argv[i], arg_length);
+        length += arg_length;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == ERROR)
+        return ERROR;
+
+    /* A daemon that doesn't answer counts against the deadline too, 0 would mean no timeout. */
+    if (deadline_ns) {
+        uint64_t now = now_ns(), left_us = deadline_ns > now ? (deadline_ns - now) / 1000 : 0;
+        struct timeval tv = { left_us / 1000000, left_us ? left_us % 1000000 : 1 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
 
-    char* dup = strdup(name);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == ERROR)
+        goto error;
 
-    memcpy(ptr, &dup, sizeof(char**));
+    for (size_t offset = 0; offset < length; offset += n) {
+        if ((n = write(fd, buf + offset, length - offset)) == ERROR) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            goto error;
+        }
+    }
+    shutdown(fd, SHUT_WR);
+
+    /* The first byte of the answer is the status of the query. */
+    if (read(fd, buf, 1) != 1)
+        goto error;
+    status = buf[0] == '0' ? 0 : 1;
+
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n == ERROR) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        fwrite(buf, 1, n, status ? stderr : stdout);
+        stats.bytes_written += n;
+        stats.writes++;
+    }
+
+    close(fd);
+    return status;
+
+error:
+    close(fd);
+    return ERROR;
 }
 
-void dwl_manager_layout(void *data, struct zdwl_ipc_manager_v1 *zdwl_ipc_manager_v1, const char *name) {
-    char** ptr = wl_array_add(&layouts, sizeof(char**));
-    if (!ptr)
-        return;
+void daemon_accept(int fd, int metrics) {
+    struct Client *client;
+    int client_fd;
 
-    char* dup = strdup(name);
+    while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != ERROR) {
+        client = ecalloc(1, sizeof(*client));
+        client->fd = client_fd;
+        client->metrics = metrics;
+        wl_list_insert(clients.prev, &client->link);
+    }
+}
+
+/* Answer a complete request, the response is sent once the socket is writable. */
+void daemon_query(struct Client *client) {
+    char *argv[ARGS_MAX + 1] = { "dwl-state" };
+    int argc = 1, status = ERROR;
+    size_t offset = 0;
+
+    while (offset < client->request_length && argc < ARGS_MAX) {
+        argv[argc++] = client->request + offset;
+        offset += strlen(client->request + offset) + 1;
+    }
+
+    /* Reserve the status byte. */
+    out.length = 0;
+    buffer_add(&out, "1", 1);
+
+    /*
+     * The client forwards its whole argv, --stats is its own and left alone
+     * here. A single --display chose the socket of this daemon already.
+     */
+    if (offset < client->request_length)
+        fail("Too many arguments");
+    else if (parse_args(argc, argv) != Action_Query || watching || controls || record_path || replay_path
+             || display_amount > 1 || hooked || metrics_file || metrics_address)
+        fail("Invalid query");
+    else if (check_query() != ERROR)
+        status = print_state(NULL);
+
+    if (status == ERROR) {
+        /* Errors are always text. */
+        format = Format_Text;
+        buffer_printf(&out, "error: %s\n", error);
+    } else {
+        out.data[0] = '0';
+    }
 
-    memcpy(ptr, &dup, sizeof(char**));
+    /* Hand the buffer over to the client, the next query gets a new one. */
+    client->response = out;
+    out = (struct Buffer){0};
+    watching = 0;
 }
 
-void global_add(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version) {
-    if (strcmp(interface, wl_output_interface.name) == EQUAL) {
-        struct wl_output* output = wl_registry_bind(registry, name, &wl_output_interface, 1);
-        monitor_setup(name, output);
+void client_read(struct Client *client) {
+    ssize_t n = read(client->fd, client->request + client->request_length,
+                     sizeof(client->request) - client->request_length);
+
+    if (n == ERROR) {
+        if (errno != EAGAIN && errno != EINTR)
+            client_cleanup(client);
         return;
     }
-    if (strcmp(interface, zdwl_ipc_manager_v1_interface.name) == EQUAL) {
-        dwl_manager = wl_registry_bind(registry, name, &zdwl_ipc_manager_v1_interface, 2);
-        zdwl_ipc_manager_v1_add_listener(dwl_manager, &dwl_manager_listener, NULL);
+
+    /* Scrapers send an http request and wait, the page is sent once its header is complete. */
+    if (client->metrics) {
+        client->request_length += n;
+        if (n == 0 || memmem(client->request, client->request_length, "\r\n\r\n", 4))
+            metrics_respond(client);
+        else if (client->request_length == sizeof(client->request))
+            client_cleanup(client);
         return;
     }
-    if (strcmp(interface, zxdg_output_manager_v1_interface.name) == EQUAL) {
-        output_manager = wl_registry_bind(registry, name, &zxdg_output_manager_v1_interface, 3);
+
+    /* The client shuts down its end once the whole request has been sent. */
+    if (n == 0) {
+        /* Make sure the last argument is terminated. */
+        if (client->request_length && client->request[client->request_length-1] != '\0') {
+            client_cleanup(client);
+            return;
+        }
+        daemon_query(client);
         return;
     }
-}
-
-void global_remove(void *data, struct wl_registry *registry, uint32_t name) {}
 
-void monitor_setup(uint32_t registry_name, struct wl_output* output) {
-    struct Monitor* monitor = ecalloc(1, sizeof(*monitor));
+    client->request_length += n;
+    if (client->request_length == sizeof(client->request))
+        client_cleanup(client);
+}
 
-    monitor->wl_output = output;
-    monitor->registry_name = registry_name;
-    monitor->active = 0;
-    monitor->layout_index = 0;
-    monitor->title = NULL;
-    monitor->appid = NULL;
+void client_write(struct Client *client) {
+    ssize_t n = send(client->fd, client->response.data + client->response_offset,
+                     client->response.length - client->response_offset, MSG_NOSIGNAL);
 
-    zxdg_output_v1_add_listener(zxdg_output_manager_v1_get_xdg_output(output_manager, output),
-                                &xdg_output_listener,
-                                monitor);
+    if (n == ERROR) {
+        if (errno != EAGAIN && errno != EINTR)
+            client_cleanup(client);
+        return;
+    }
 
-    wl_list_insert(&monitors, &monitor->link);
+    client->response_offset += n;
+    stats.bytes_written += n;
+    stats.writes++;
+    if (client->response_offset == client->response.length)
+        client_cleanup(client);
 }
 
-void monitor_cleanup(struct Monitor *monitor) {
-    free(monitor->tags);
-    free(monitor->title);
-    zdwl_ipc_output_v1_destroy(monitor->dwl_output);
+void client_cleanup(struct Client *client) {
+    wl_list_remove(&client->link);
+    close(client->fd);
+    free(client->response.data);
+    free(client);
 }
 
-void setup(void) {
-    wl_array_init(&tags);
-    wl_array_init(&layouts);
-    wl_list_init(&monitors);
-
-    display = wl_display_connect(NULL);
-    if (!display)
-        die("Could not connect to wayland display");
-
-    display_fd = wl_display_get_fd(display);
+void daemon_run(void) {
+    struct Client *client, *tmp;
+    size_t amount, i;
+    uint64_t start;
+    int fd;
+
+    listen_addr.sun_family = AF_UNIX;
+    if (socket_path(listen_addr.sun_path, sizeof(listen_addr.sun_path)) == ERROR)
+        die("Could not determine socket path, is XDG_RUNTIME_DIR set?");
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == ERROR)
+        die("socket:");
+    if (connect(fd, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) != ERROR) {
+        close(fd);
+        die("dwl-stated is already running on %s", listen_addr.sun_path);
+    }
+    close(fd);
+    /* Nobody is listening, so whatever is there is stale. */
+    unlink(listen_addr.sun_path);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == ERROR)
+        die("socket:");
+    if (bind(listen_fd, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) == ERROR)
+        die("bind:");
+    if (listen(listen_fd, SOMAXCONN) == ERROR)
+        die("listen:");
+
+    shm_setup();
+    if (metrics_address)
+        metrics_setup();
+    if (metrics_path)
+        metrics_write();
+
+    setup_signals();
+    if (hooked)
+        hook_setup();
+
+    running = 1;
+    while (running) {
+        amount = DAEMON_POLLFDS + wl_list_length(&clients);
+        if (amount > pollfds_size) {
+            pollfds = erealloc(pollfds, amount * sizeof(*pollfds));
+            pollfds_size = amount;
+        }
 
-    struct wl_registry *registry = wl_display_get_registry(display);
-    wl_registry_add_listener(registry, &registry_listener, NULL);
-    wl_display_roundtrip(display);
+        display_prepare(contexts, &pollfds[0]);
+        pollfds[1] = (struct pollfd){listen_fd, POLLIN};
+        pollfds[2] = (struct pollfd){hook_fd, POLLIN};
+        pollfds[3] = (struct pollfd){metrics_fd, POLLIN};
+        i = DAEMON_POLLFDS;
+        wl_list_for_each(client, &clients, link) {
+            pollfds[i++] = (struct pollfd){client->fd, client->response.data ? POLLOUT : POLLIN};
+        }
 
-    check_global(output_manager, "output_manager");
-    check_global(dwl_manager, "dwl_manager");
+        if (poll(pollfds, amount, -1) == ERROR) {
+            if (errno != EINTR)
+                die("poll:");
+            continue;
+        }
 
-    wl_display_roundtrip(display);
+        /* The display goes first, the queries below are answered from the state it brought. */
+        start = stats_start();
+        display_dispatch(contexts, pollfds[0].revents);
+        if (pollfds[0].revents & POLLIN)
+            stats_end(Phase_Dispatch, start);
 
-    struct Monitor *monitor;
-    wl_list_for_each(monitor, &monitors, link) {
-        /*
-         * We must initialize tags before we add dwl_output listener.
-         */
-        struct Tag *monitor_tags = ecalloc(WL_ARRAY_LENGHT(&tags, char**), sizeof(*monitor_tags));
-        for (int i = 0; i < WL_ARRAY_LENGHT(&tags, char**); i++) {
-            struct Tag *tag = &monitor_tags[i];
-            tag->state = 0;
-            tag->is_focused = 0;
-            tag->client_amount = 0;
+        /* Clients accepted below are appended, so the order still matches pollfds. */
+        i = DAEMON_POLLFDS;
+        wl_list_for_each_safe(client, tmp, &clients, link) {
+            if (i == amount)
+                break;
+            short revents = pollfds[i++].revents;
+
+            if (revents & POLLIN)
+                client_read(client);
+            else if (revents & POLLOUT)
+                client_write(client);
+            else if (revents & (POLLHUP | POLLERR))
+                client_cleanup(client);
         }
-        monitor->tags = monitor_tags;
 
-        monitor->dwl_output = zdwl_ipc_manager_v1_get_output(dwl_manager, monitor->wl_output);
-        zdwl_ipc_output_v1_add_listener(monitor->dwl_output, &dwl_output_listener, monitor);
-    }
+        if (pollfds[1].revents & POLLIN)
+            daemon_accept(listen_fd, 0);
 
-    wl_display_roundtrip(display);
+        if (pollfds[3].revents & POLLIN)
+            daemon_accept(metrics_fd, 1);
 
-    pollfds = ecalloc(POLLFDS, sizeof(*pollfds));
+        if (pollfds[2].revents & POLLIN)
+            hook_reap();
 
-    pollfds[0] = (struct pollfd){display_fd, POLLIN};
+    }
 }
 
-int main(int argc, char *argv[]) {
-    int i, opt = 0, tagmask = 0;
-    char *wanted_monitor = NULL;
-    struct Monitor *monitor;
-
-    setup();
-
-    while(opt != -1)  {
-        opt = getopt(argc, argv, "vho:Ot:TeEaAsilLfcpn");
+/* Parse the arguments into noun, verb and the filters, this does not need any state. */
+int parse_args(int argc, char *argv[]) {
+    int opt, tag, action = Action_Query;
+    const char *name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+
+    noun = verb = 0;
+    tagmask = (struct Tagset){0};
+    format = default_format;
+    watching = full_snapshots = print_layouts = read_shm = batch = 0;
+    controls = confirm = stats_requested = throttling = realtime = 0;
+    record_path = replay_path = NULL;
+    display_amount = 0;
+    memset(hook_commands, 0, sizeof(hook_commands));
+    hooked = 0;
+    metrics_file = metrics_address = NULL;
+    timeout_ms = 0;
+    condition_amount = 0;
+    memset(throttles, 0, sizeof(throttles));
+    wanted_monitor = control_layout_name = NULL;
+    template = default_template.length ? &default_template : NULL;
+
+    if (strcmp(name, "dwl-stated") == EQUAL)
+        action = Action_Daemon;
+
+    /* Reset getopt, so that the daemon can parse more than one request. */
+    optind = 0;
+    while ((opt = getopt_long(argc, argv, "vhdbgo:Ot:TeEaAsilLfcpnwF", long_options, NULL)) != -1) {
         switch (opt) {
             case 'v':
-                printf("dwl-state %.1f\n", VERSION);
-                goto done;
+                return Action_Version;
             case 'h':
-                goto usage;
+                return Action_Usage;
+            case 'd':
+                action = Action_Daemon;
+                break;
+            case 'b':
+                batch = 1;
+                break;
             case 'L':
-                print_wl_array(&layouts);
+                print_layouts = 1;
                 break;
             case 'e':
                 verb |= Verb_All;
@@ -473,14 +2977,18 @@ int main(int argc, char *argv[]) {
             case 'E':
                 noun |= Noun_All;
                 break;
+            case 'g':
+                noun |= Totals;
+                break;
             case 't':
-                if (!(noun & Tags))
-                    noun |= Tags;
+                noun |= Tags;
 
-                int tag = atoi(optarg);
-                if (!tag || tag < 1 || tag > WL_ARRAY_LENGHT(&tags, char**))
-                    die("%s is not a valid number or index", optarg);
-                tagmask |= 1 << (tag-1);
+                tag = atoi(optarg);
+                if (tag < 1 || tag > MAX_TAGS) {
+                    fail("%s is not a valid number or index", optarg);
+                    return Action_Error;
+                }
+                tagset_add(&tagmask, tag-1);
 
                 break;
             case 'T':
@@ -488,11 +2996,7 @@ int main(int argc, char *argv[]) {
                 break;
             case 'o':
                 noun |= Outputs;
-
-                if (!check_for_framed(optarg))
-                    die("%s is not a valid monitor", optarg);
                 wanted_monitor = optarg;
-
                 break;
             case 'O':
                 noun |= Outputs;
@@ -524,79 +3028,697 @@ int main(int argc, char *argv[]) {
             case 'n':
                 verb |= No_Labels;
                 break;
-            case ':':
-                goto usage;
-            case '?':
-                goto usage;
+            case 'w':
+                watching = 1;
+                break;
+            case 'F':
+                full_snapshots = 1;
+                break;
+            case Option_Shm:
+                read_shm = 1;
+                break;
+            case Option_Set_Tags:
+                controls |= Control_Tags;
+                if (parse_tags(optarg, &control_tags) == ERROR)
+                    return Action_Error;
+                break;
+            case Option_Set_Layout:
+                controls |= Control_Layout;
+                control_layout_name = optarg;
+                break;
+            case Option_Set_Client_Tags:
+            case Option_Toggle_Client_Tags:
+                controls |= Control_Client_Tags;
+                if (parse_tags(optarg, &control_xor_tags) == ERROR)
+                    return Action_Error;
+                /* new_tags = (current_tags & and_tags) ^ xor_tags */
+                control_and_tags = opt == Option_Set_Client_Tags ? 0 : ~0;
+                break;
+            case Option_Confirm:
+                confirm = 1;
+                break;
+            case Option_Stats:
+                stats_requested = 1;
+                break;
+            case Option_Template:
+                if (template_compile(optarg) == ERROR)
+                    return Action_Error;
+                break;
+            case Option_Throttle:
+                if (parse_throttle(optarg) == ERROR)
+                    return Action_Error;
+                break;
+            case Option_Record:
+                record_path = optarg;
+                break;
+            case Option_Replay:
+                replay_path = optarg;
+                break;
+            case Option_Realtime:
+                realtime = 1;
+                break;
+            case Option_Hook:
+                if (parse_hook(optarg) == ERROR)
+                    return Action_Error;
+                break;
+            case Option_Hook_Jobs:
+                hook_jobs = atoi(optarg);
+                if (hook_jobs < 1) {
+                    fail("%s is not a valid number of jobs", optarg);
+                    return Action_Error;
+                }
+                break;
+            case Option_Timeout:
+                timeout_ms = atoi(optarg);
+                if (timeout_ms < 1) {
+                    fail("%s is not a valid timeout", optarg);
+                    return Action_Error;
+                }
+                break;
+            case Option_Wait:
+                if (parse_wait(optarg) == ERROR)
+                    return Action_Error;
+                break;
+            case Option_Metrics_File:
+                metrics_file = optarg;
+                break;
+            case Option_Metrics_Listen:
+                metrics_address = optarg;
+                break;
+            case Option_Display:
+                if (display_amount == DISPLAYS_MAX) {
+                    fail("There can't be more than %d displays", DISPLAYS_MAX);
+                    return Action_Error;
+                }
+                display_names[display_amount++] = optarg;
+                break;
+            case Option_Format:
+                for (format = Format_Text; format <= Format_Tlv; format++)
+                    if (strcmp(optarg, format_names[format]) == EQUAL)
+                        break;
+
+                if (format > Format_Tlv) {
+                    fail("%s is not a valid format", optarg);
+                    return Action_Error;
+                }
+                break;
+            default:
+                return Action_Usage;
         }
     }
 
-    if (!noun && !verb)
-        goto done;
+    /* The template takes the place of the verbs, verbs in a -b query replace the one given to -b. */
+    if (template == &default_template && (verb || noun & Tags || noun & Active_Tag || noun & Totals))
+        template = NULL;
+
+    if (template && (verb || noun & Tags || noun & Active_Tag || noun & Totals)) {
+        fail("--template can't be used with verbs, tags or -g");
+        return Action_Error;
+    }
+
+    if (template && format != Format_Text) {
+        fail("--template only prints text");
+        return Action_Error;
+    }
+
+    if (throttling && (!watching || replay_path)) {
+        fail("--throttle can only be used with -w");
+        return Action_Error;
+    }
+
+    /* A replay answers a single query, there is nothing to change or to ask a daemon. */
+    if (replay_path && (action == Action_Daemon || batch || controls || read_shm || record_path)) {
+        fail("--replay can only be used with queries and -w");
+        return Action_Error;
+    }
+
+    if (realtime && !replay_path) {
+        fail("--realtime can only be used with --replay");
+        return Action_Error;
+    }
+
+    if (record_path && read_shm) {
+        fail("--record needs a connection to dwl");
+        return Action_Error;
+    }
+
+    if (hooked && ((!watching && action != Action_Daemon) || replay_path)) {
+        fail("--hook can only be used with -w or -d");
+        return Action_Error;
+    }
+
+    if (metrics_file && ((!watching && action != Action_Daemon) || replay_path)) {
+        fail("--metrics-file can only be used with -w or -d");
+        return Action_Error;
+    }
+
+    if (metrics_address && action != Action_Daemon) {
+        fail("--metrics-listen can only be used with -d");
+        return Action_Error;
+    }
+
+    if (condition_amount && (watching || action == Action_Daemon || batch || controls || read_shm || replay_path)) {
+        fail("--wait can only be used with queries");
+        return Action_Error;
+    }
+
+    if (display_amount > 1 && (action == Action_Daemon || batch || controls || read_shm || record_path || replay_path)) {
+        fail("Several displays can only be used with queries and -w");
+        return Action_Error;
+    }
+
+    return action;
+}
+
+/*
+ * Decide what has to be bound for the parsed query, so that
+ * e.g. listing the layouts doesn't create objects for every output.
+ */
+int plan_query(int action) {
+    if (action == Action_Daemon || watching || batch || controls || verb || template || record_path || condition_amount)
+        return Need_Outputs | Need_State;
+
+    /* Listing names. */
+    if (noun & Outputs && !(noun & Totals))
+        return Need_Outputs;
+    if (noun & Tags && !(noun & Totals))
+        return Need_Manager;
+
+    if (noun)
+        return Need_Outputs | Need_State;
+
+    return Need_Manager;
+}
+
+/* Parse a comma separated list of tag indices, like 1,3 into a mask. */
+int parse_tags(const char *list, uint32_t *mask) {
+    const char *c = list;
+    char *end;
+    long tag;
+
+    *mask = 0;
+    do {
+        tag = strtol(c, &end, 10);
+        if (end == c || tag < 1 || tag > IPC_TAGS || (*end && *end != ','))
+            return fail("%s is not a valid list of tags", list);
+
+        *mask |= 1u << (tag-1);
+        c = end + 1;
+    } while (*end);
+
+    return 0;
+}
+
+/* Parse event=command, like urgent=notify-send urgent. */
+int parse_hook(const char *hook) {
+    const char *command = strchr(hook, '=');
+    int event;
+
+    for (event = 0; command && event < Hook_Amount; event++)
+        if (strlen(hook_names[event]) == (size_t)(command - hook) && strncmp(hook_names[event], hook, command - hook) == EQUAL)
+            break;
+
+    if (!command || event == Hook_Amount || !command[1])
+        return fail("%s is not a valid hook", hook);
+
+    hook_commands[event] = command + 1;
+    hooked = 1;
+    return 0;
+}
+
+/* Parse a --wait like occupied, clients=2 or appid=foot into a condition. */
+int parse_wait(const char *wait) {
+    const char *value = strchr(wait, '=');
+    size_t length = value ? (size_t)(value - wait) : strlen(wait);
+    struct Condition *condition;
+    char *end;
+    long clients;
+
+    if (condition_amount == CONDITIONS_MAX)
+        return fail("There can't be more than %d --wait", CONDITIONS_MAX);
+
+    condition = &conditions[condition_amount];
+    *condition = (struct Condition){Wait_Amount};
+    for (int i = 0; i < Wait_Amount; i++)
+        if (strlen(wait_names[i]) == length && strncmp(wait_names[i], wait, length) == EQUAL)
+            condition->wait = i;
+
+    /* clients, layout, appid and title take a value, the others don't. */
+    if (condition->wait == Wait_Amount || (condition->wait == Wait_Clients || condition->wait > Wait_Active) != !!value)
+        return fail("%s is not a valid condition", wait);
+
+    switch (condition->wait) {
+        case Wait_Urgent:
+            condition->state = DWL_STATE_TAG_URGENT;
+            break;
+        case Wait_Occupied:
+            condition->clients = 1;
+            break;
+        case Wait_Clients:
+            clients = strtol(value + 1, &end, 10);
+            if (end == value + 1 || *end || clients < 1 || clients > UINT32_MAX)
+                return fail("%s is not a valid number of clients", value + 1);
+            condition->clients = clients;
+            break;
+        case Wait_Layout:
+        case Wait_Appid:
+        case Wait_Title:
+            condition->text = value + 1;
+            break;
+        default:
+            break;
+    }
 
-    if (noun & Outputs && !verb) {
-        wl_list_for_each(monitor, &monitors, link) {
-            printf("%s ", monitor->xdg_name);
+    condition_amount++;
+    return 0;
+}
+
+/*
+ * Parse a comma separated list of field=milliseconds, like title=200,appid=500.
+ * Milliseconds without a field apply to every field.
+ */
+int parse_throttle(const char *list) {
+    const char *c = list;
+    char *end;
+    size_t length;
+    long ms;
+    int field;
+
+    do {
+        field = Throttle_Amount;
+        length = strcspn(c, "=,");
+        if (c[length] == '=') {
+            for (field = 0; field < Throttle_Amount; field++)
+                if (strlen(throttle_fields[field].name) == length && strncmp(throttle_fields[field].name, c, length) == EQUAL)
+                    break;
+
+            if (field == Throttle_Amount)
+                return fail("%.*s is not a field that can be throttled", (int)length, c);
+            c += length + 1;
         }
-        printf("\n");
-        goto done;
+
+        ms = strtol(c, &end, 10);
+        if (end == c || ms < 0 || (*end && *end != ','))
+            return fail("%s is not a valid list of throttles", list);
+
+        for (int i = 0; i < Throttle_Amount; i++) {
+            if (field == Throttle_Amount || field == i)
+                throttles[i] = ms * 1000000;
+        }
+        c = end + 1;
+    } while (*end);
+
+    throttling = 1;
+    return 0;
+}
+
+/*
+ * Send the requested changes to the outputs the nouns select, the active
+ * output by default. All requests go out with a single flush.
+ */
+int apply_controls(void) {
+    uint64_t start = stats_start();
+    struct Monitor *monitor;
+    struct pollfd pollfd;
+    int timeout, ready, status = 0;
+
+    FOR_EACH_MONITOR(monitor, ctx) {
+        if (wanted_monitor) {
+            if (strcmp(monitor->xdg_name, wanted_monitor) != EQUAL)
+                continue;
+        } else if (!(noun & Outputs || noun & Noun_All) && !dwl_state_output_active(monitor->output)) {
+            continue;
+        }
+
+        if (controls & Control_Tags)
+            dwl_state_output_set_tags(monitor->output, control_tags, 0);
+        if (controls & Control_Layout)
+            dwl_state_output_set_layout(monitor->output, control_layout);
+        if (controls & Control_Client_Tags)
+            dwl_state_output_set_client_tags(monitor->output, control_and_tags, control_xor_tags);
     }
 
-    if (noun & Tags && !verb) {
-        print_wl_array(&tags);
-        goto done;
+    /*
+     * dwl answers the requests in order, so after a roundtrip we've got the
+     * frame with the new state. There is no frame if nothing changed.
+     */
+    if (confirm || verb || print_layouts || template) {
+        if (dwl_state_sync(ctx->state) == ERROR)
+            die("dwl_state_sync:");
+        setup_wait();
+        stats_end(Phase_Controls, start);
+        return 0;
     }
 
-    if (noun & Active_Output && !verb) {
-        printf("%s", get_active_monitor()->xdg_name);
+    /* Without a roundtrip nothing else sends them, they have to be out before we exit. */
+    while (dwl_state_flush(ctx->state) == ERROR) {
+        if (errno != EAGAIN) {
+            status = fail("Could not send the changes to %s: %s", context_name(), strerror(errno));
+            break;
+        }
+
+        pollfd = (struct pollfd){dwl_state_get_fd(ctx->state), POLLOUT};
+        timeout = deadline_timeout();
+        ready = timeout ? poll(&pollfd, 1, timeout) : 0;
+        if (ready == ERROR && errno != EINTR)
+            die("poll:");
+        if (ready == 0) {
+            ctx->timed_out = 1;
+            break;
+        }
+        if (ready > 0 && pollfd.revents & (POLLHUP | POLLERR)) {
+            status = fail("Lost connection to wayland display %s", context_name());
+            break;
+        }
     }
 
-    if (noun & Active_Tag && !verb) {
-        struct Monitor *active_monitor = get_active_monitor();
-        struct Tag *tag;
-        for (int i = 0; i < WL_ARRAY_LENGHT(&tags, char**); i++) {
-            tag = &active_monitor->tags[i];
-            if (tag->is_focused)
-                printf("%s %d", active_monitor->xdg_name, i+1);
+    stats_end(Phase_Controls, start);
+    return status;
+}
+
+/*
+ * Answer one query per line of stdin, all from the same state.
+ * Every answer is followed by an empty line, errors go to stderr.
+ */
+int batch_run(void) {
+    char *line = NULL, *argv[ARGS_MAX + 1];
+    size_t size = 0;
+    int argc, status = 0;
+
+    /* The options given to -b apply to every query. */
+    default_format = format;
+    if (template)
+        default_template = *template;
+
+    while (getline(&line, &size, stdin) != ERROR) {
+        argc = 0;
+        argv[argc++] = "dwl-state";
+        for (char *arg = strtok(line, " \t\n"); arg; arg = strtok(NULL, " \t\n")) {
+            if (argc == ARGS_MAX)
+                break;
+            argv[argc++] = arg;
+        }
+        argv[argc] = NULL;
+
+        if (argc == ARGS_MAX) {
+            status = fail("Too many arguments");
+        } else if (parse_args(argc, argv) != Action_Query || watching || batch || read_shm || controls || stats_requested
+                || record_path || replay_path || display_amount || hooked || metrics_file || metrics_address) {
+            status = fail("Invalid query");
+        } else if (check_query() == ERROR || print_state(NULL) == ERROR) {
+            status = ERROR;
+        } else {
+            goto answered;
         }
+        fprintf(stderr, "error: %s\n", error);
+
+answered:
+        buffer_printf(&out, "\n");
+        if (buffer_flush(&out, STDOUT_FILENO) == ERROR)
+            die("write:");
     }
 
-    if ((noun & Tags || noun & Active_Tag) && !(verb & Focused || verb & Clients || verb & Verb_All))
-        goto done;
+    free(line);
+    return status;
+}
 
-    if ((noun & Outputs || noun & Active_Output) && !(verb & State || verb & Appid || verb & Title || verb & Layout || verb & Verb_All)) {
-        goto done;
+/* Check the parsed query against the state we got from dwl. */
+int check_query(void) {
+    int tag_amount = dwl_state_tag_amount(ctx->state);
+    int tag = tagset_next(&tagmask, tag_amount);
+
+    if (tag != ERROR)
+        return fail("%d is not a valid number or index", tag+1);
+
+    if (control_layout_name) {
+        for (control_layout = 0; control_layout < dwl_state_layout_amount(ctx->state); control_layout++)
+            if (strcmp(dwl_state_layout_name(ctx->state, control_layout), control_layout_name) == EQUAL)
+                break;
+
+        if (control_layout == dwl_state_layout_amount(ctx->state))
+            return fail("%s is not a valid layout", control_layout_name);
     }
 
-    if ((!(noun & Tags) && !(noun & Active_Tag)) && (verb & Focused || verb & Clients)) {
-        noun |= Active_Tag;
+    for (int i = 0; i < condition_amount; i++) {
+        const char *text;
+        size_t layout;
+
+        if (conditions[i].wait != Wait_Layout && conditions[i].wait != Wait_Appid)
+            continue;
+        if (!(text = dwl_state_intern(ctx->state, conditions[i].text)))
+            die("dwl_state_intern:");
+        conditions[i].interned[ctx - contexts] = text;
+
+        if (conditions[i].wait != Wait_Layout)
+            continue;
+        for (layout = 0; layout < dwl_state_layout_amount(ctx->state); layout++)
+            if (dwl_state_layout_name(ctx->state, layout) == text)
+                break;
+
+        if (layout == dwl_state_layout_amount(ctx->state))
+            return fail("%s is not a valid layout", conditions[i].text);
     }
 
-    if ((!(noun & Outputs) && !wanted_monitor) || noun & Active_Output) {
-        if (verb & State || verb & Appid || verb & Title || verb & Layout)
-            noun |= Outputs;
+    if (tag_amount < IPC_TAGS && (control_tags | control_xor_tags) >> tag_amount)
+        return fail("The tags have to be between 1 and %d", tag_amount);
 
-        struct Monitor *active_monitor = get_active_monitor();
-        if (!active_monitor)
-            exit(EXIT_FAILURE);
-        wanted_monitor = active_monitor->xdg_name;
+    /* Without the dwl state there are no frames, outputs are listed once they have a name. */
+    if (wanted_monitor && !check_for_framed(wanted_monitor))
+        return fail("%s is not a valid monitor", wanted_monitor);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t start = now_ns();
+    int action, status;
+
+    action = parse_args(argc, argv);
+    if (stats_requested) {
+        show_stats = 1;
+        stats_end(Phase_Args, start);
+        atexit(stats_print);
+    }
+    switch (action) {
+        case Action_Version:
+            printf("dwl-state %.1f\n", VERSION);
+            return EXIT_SUCCESS;
+        case Action_Usage:
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        case Action_Error:
+            die("%s", error);
+    }
+
+    /* The deadline counts from the start, a slow daemon or connect eats into it. */
+    if (timeout_ms)
+        deadline_ns = start + (uint64_t)timeout_ms * 1000000;
+
+    /* The daemon parses every query again, these have to outlive that. */
+    memcpy(hooks, hook_commands, sizeof(hooks));
+    metrics_path = metrics_file;
+    metering = metrics_file || metrics_address;
+
+    /* One display is the same as WAYLAND_DISPLAY, so that the daemon and the snapshot follow it. */
+    if (display_amount == 1)
+        setenv("WAYLAND_DISPLAY", display_names[0], 1);
+
+    context_amount = display_amount > 1 ? display_amount : 1;
+    contexts = ecalloc(context_amount, sizeof(*contexts));
+    for (int i = 0; i < display_amount && display_amount > 1; i++)
+        contexts[i].name = display_names[i];
+    ctx = contexts;
+
+    if (record_path)
+        log_open(record_path);
+
+    switch (action) {
+        case Action_Daemon:
+            plan = plan_query(action);
+            setup();
+            if (setup_timed_out()) {
+                cleanup();
+                return EXIT_TIMEOUT;
+            }
+            /* Only the setup has a deadline. */
+            deadline_ns = 0;
+            daemon_run();
+            cleanup();
+            return EXIT_SUCCESS;
     }
 
-    if (noun & Noun_All || (noun & Outputs && !wanted_monitor)) {
-        wl_list_for_each(monitor, &monitors, link) {
-            monitor_output(monitor, tagmask);
+    if (batch) {
+        if (watching)
+            die("-b can't be used with -w");
+        plan = plan_query(action);
+        if (!read_shm)
+            setup();
+        else if (shm_load() == ERROR)
+            die("%s", error);
+
+        if (setup_timed_out()) {
+            cleanup();
+            return EXIT_TIMEOUT;
         }
-    } else {
-        monitor = get_monitor_from_name(wanted_monitor);
-        monitor_output(monitor, tagmask);
+
+        status = batch_run();
+        cleanup();
+        return status == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
     }
 
-    goto done;
+    if (!noun && !verb && !print_layouts && !controls && !template && !condition_amount)
+        return EXIT_SUCCESS;
+
+    if (replay_path) {
+        status = replay_run();
+        if (status == ERROR)
+            die("%s", error);
+        if (buffer_flush(&out, STDOUT_FILENO) == ERROR)
+            die("write:");
+        return EXIT_SUCCESS;
+    }
+
+    if (read_shm) {
+        if (controls)
+            die("--shm can't be used to change the state");
+        if (watching)
+            die("--shm can't be used with -w");
+        if (shm_load() == ERROR || check_query() == ERROR)
+            die("%s", error);
+
+        status = print_state(NULL);
+        if (buffer_flush(&out, STDOUT_FILENO) == ERROR)
+            die("write:");
+        return status == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* Let a running daemon answer, we only need wayland if there is none. */
+    if (!watching && !controls && !record_path && !condition_amount && context_amount == 1) {
+        start = stats_start();
+        status = client_query(argc, argv);
+        stats_end(Phase_Daemon, start);
+        if (status != ERROR)
+            return status ? EXIT_FAILURE : EXIT_SUCCESS;
+
+        if (deadline_ns && now_ns() >= deadline_ns) {
+            fprintf(stderr, "error: dwl-stated didn't answer within %dms\n", timeout_ms);
+            return EXIT_TIMEOUT;
+        }
+    }
+
+    plan = plan_query(action);
+    setup();
+
+    /* Watching a display that isn't set up would print its state whenever it is, as updates. */
+    if (setup_timed_out() && (watching || context_amount == 1)) {
+        cleanup();
+        return EXIT_TIMEOUT;
+    }
+
+    /* The displays that answered in time are printed, the others were reported. */
+    status = 0;
+    for (ctx = contexts; ctx < contexts + context_amount; ctx++) {
+        if (ctx->timed_out) {
+            status = EXIT_TIMEOUT;
+            continue;
+        }
+
+        if (check_query() == ERROR) {
+            if (context_amount > 1)
+                die("%s: %s", context_name(), error);
+            die("%s", error);
+        }
+
+        if (controls) {
+            if (apply_controls() == ERROR) {
+                fprintf(stderr, "error: %s\n", error);
+                status = ERROR;
+                continue;
+            }
+            if (ctx->timed_out) {
+                fprintf(stderr, "error: dwl didn't take the changes within %dms\n", timeout_ms);
+                status = EXIT_TIMEOUT;
+                continue;
+            }
+        }
+
+        /* With controls, nouns without verbs only select the outputs. --wait prints once it held. */
+        if (!(controls && !verb && !print_layouts && !template) && !condition_amount && print_state(NULL) == ERROR)
+            status = ERROR;
+    }
+
+    if (condition_amount) {
+        if (wait_run() == ERROR) {
+            if (deadline_ns && now_ns() >= deadline_ns) {
+                fprintf(stderr, "error: The conditions didn't hold within %dms\n", timeout_ms);
+                status = EXIT_TIMEOUT;
+            } else {
+                status = ERROR;
+            }
+        } else if (verb || print_layouts || template) {
+            ctx = waited;
+            if (print_state(NULL) == ERROR)
+                status = ERROR;
+            ctx = contexts;
+        }
+    }
+    if (buffer_flush(&out, STDOUT_FILENO) == ERROR)
+        die("write:");
+
+    if (watching) {
+        deadline_ns = 0;
+        run();
+    }
+
+    cleanup();
+    if (status == EXIT_TIMEOUT)
+        return EXIT_TIMEOUT;
+    return status == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Only read the clock with --stats, watch mode times every frame. */
+uint64_t stats_start(void) {
+    return show_stats ? now_ns() : 0;
+}
+
+void stats_end(enum Phase phase, uint64_t start) {
+    if (!show_stats)
+        return;
+
+    stats.phase_ns[phase] += now_ns() - start;
+    stats.phase_calls[phase]++;
+}
+
+/* Printed to stderr at exit, so that it doesn't mix with the answer. */
+void stats_print(void) {
+    fprintf(stderr, "%-28s %10s %12s\n", "phase", "calls", "ms");
+    for (int i = 0; i < Phase_Amount; i++) {
+        if (stats.phase_calls[i])
+            fprintf(stderr, "%-28s %10u %12.3f\n", phase_names[i], stats.phase_calls[i], stats.phase_ns[i] / 1e6);
+    }
+
+    fprintf(stderr, "%-28s %10s\n", "event", "count");
+    for (int i = 0; i < Event_Amount; i++) {
+        if (stats.events[i])
+            fprintf(stderr, "%-28s %10lu\n", event_names[i], (unsigned long)stats.events[i]);
+    }
 
-usage:
-    printf("Usage: %s [-option args]\n", argv[0]);
+    fprintf(stderr, "%-28s %10lu\n", "bytes written", (unsigned long)stats.bytes_written);
+    fprintf(stderr, "%-28s %10lu\n", "writes", (unsigned long)stats.writes);
+}
+
+void usage(const char *name) {
+    printf("Usage: %s [-option args]\n", name);
     printf("-h               -- Print this message.\n");
     printf("-v               -- Print the version and exit.\n");
+    printf("-d               -- Run as a daemon that answers queries over a socket.\n");
+    printf("-b               -- Answer one query per line of stdin, followed by an empty line.\n");
     printf("--     Nouns     --\n");
     printf("-t [tag index]   -- Filter to a specific tag based on index.\n");
     printf("-T               -- Filter to all tags for an output.\n");
@@ -607,11 +3729,42 @@ usage:
     printf("-a               -- Filter to the active output.\n");
     printf("-A               -- Filter to the active tag.\n");
     printf("-E               -- Filter to all outputs and all tags same as -O and -T.\n");
+    printf("-g               -- Filter to the totals over all outputs, the active output and the occupied tags.\n");
+    printf("                    With -s or -c, the state and clients of every tag summed over all outputs.\n");
     printf("--  Global Verbs --\n");
     printf("-L               -- Print available layout names.\n");
     printf("-s               -- Print the state of the object, tags if specified, output if no tags.\n");
     printf("-e               -- Print all information about a specified object, if no objects like tags or outputs specifed then print everything.\n");
     printf("-n               -- Print information with out labels.\n");
+    printf("-w               -- Keep running and print the requested information that changed on every update.\n");
+    printf("-F               -- With -w, print all of the requested information on every update.\n");
+    printf("--format [fmt]   -- Print as text (default), json, nul or tlv.\n");
+    printf("--shm            -- Read the state from the snapshot dwl-stated publishes.\n");
+    printf("--stats          -- Print the time spent in every phase, the events received and the bytes written to stderr at exit.\n");
+    printf("--throttle [list] -- With -w, print changes of a field at most every so many ms, like title=200,appid=500.\n");
+    printf("                    The fields are active, tags, layout, title and appid, a bare number applies to all.\n");
+    printf("--record [file]  -- Write every event dwl sends to a file, to --replay it later.\n");
+    printf("--replay [file]  -- Answer the query, or -w, from the events in a file instead of dwl.\n");
+    printf("--realtime       -- Replay the events as fast as they were recorded, not as fast as possible.\n");
+    printf("--display [name] -- Query the display instead of WAYLAND_DISPLAY, give it more than once to query several.\n");
+    printf("--hook [event=cmd] -- With -w or -d, run cmd with sh when an event happens: urgent, active, layout or occupied.\n");
+    printf("                    The values are in DWL_HOOK, DWL_DISPLAY, DWL_OUTPUT, DWL_ACTIVE, DWL_LAYOUT, DWL_TAG and DWL_CLIENTS.\n");
+    printf("--hook-jobs [n]  -- Run at most n hooks at once, 4 by default.\n");
+    printf("--metrics-file [path] -- With -w or -d, keep path up to date with metrics of the state, for node_exporter's textfile collector.\n");
+    printf("--metrics-listen [addr] -- With -d, serve the metrics over http on the unix socket addr, or on a port of localhost.\n");
+    printf("--wait [condition] -- Wait until urgent, occupied, clients=n, active, layout=name, appid=name or title=text holds\n");
+    printf("                    on the selected outputs and tags, then print the verbs.\n");
+    printf("--timeout [ms]   -- Give up on dwl after ms and exit with 2, other displays are still printed.\n");
+    printf("--template [tpl] -- Print a line per output from a template like '{output} {layout} {tag.focused} {title}'.\n");
+    printf("                    Fields: output, active, title, appid, layout, tag.focused, tag.clients,\n");
+    printf("                    tags.active, tags.urgent and tags.occupied. {{ and }} are literal braces.\n");
+    printf("--   Controls    --\n");
+    printf("Controls change the active output, or the outputs selected with -o, -O or -E.\n");
+    printf("--set-tags [tags]           -- View the comma separated list of tags, like 1,3.\n");
+    printf("--set-layout [layout]       -- Set the layout by name, see -L.\n");
+    printf("--set-client-tags [tags]    -- Move the focused client to the tags.\n");
+    printf("--toggle-client-tags [tags] -- Toggle the tags of the focused client.\n");
+    printf("--confirm                   -- Wait until dwl applied the changes. Implied by other verbs.\n");
     printf("--  Output Verbs --\n");
     printf("-p               -- Get the appid of an output, if none specified get the active output.\n");
     printf("-i               -- Get the title of an output, if none specified get the active output.\n");
@@ -621,28 +3774,68 @@ usage:
     printf("-c               -- Get the client amount of a specified tag, if none specified get the active tag.\n");
 
     fflush(stdout);
-
-done:
-    cleanup();
-    exit(EXIT_SUCCESS);
 }
 
 void cleanup(void) {
-    struct Monitor *monitor, *tmp;
-    wl_list_for_each_safe(monitor, tmp, &monitors, link) {
-        monitor_cleanup(monitor);
+    struct dwl_state_output *output, *next;
+    struct Monitor *monitor;
+    struct Client *client, *client_tmp;
+
+    if (listen_fd != ERROR) {
+        wl_list_for_each_safe(client, client_tmp, &clients, link) {
+            client_cleanup(client);
+        }
+        close(listen_fd);
+        unlink(listen_addr.sun_path);
+        listen_fd = ERROR;
+    }
+
+    if (shm_state) {
+        munmap(shm_state, sizeof(*shm_state));
+        shm_unlink(shm_path);
+        shm_state = NULL;
+    }
+
+    if (throttle_fd != ERROR) {
+        close(throttle_fd);
+        throttle_fd = ERROR;
+    }
+
+    if (hook_fd != ERROR) {
+        close(hook_fd);
+        hook_fd = ERROR;
+    }
+
+    if (metrics_fd != ERROR) {
+        close(metrics_fd);
+        if (metrics_addr.sun_path[0])
+            unlink(metrics_addr.sun_path);
+        metrics_fd = ERROR;
     }
+    free(metrics_buffer.data);
+    metrics_buffer = (struct Buffer){0};
 
-    char** ptr;
-    wl_array_for_each(ptr, &tags)
-        free(*ptr);
-    wl_array_for_each(ptr, &layouts)
-        free(*ptr);
-    wl_array_release(&tags);
-    wl_array_release(&layouts);
+    if (log_fd != ERROR) {
+        log_flush();
+        close(log_fd);
+        log_fd = ERROR;
+    }
+
+    for (ctx = contexts; ctx < contexts + context_amount; ctx++) {
+        if (!ctx->state)
+            continue;
+
+        /* monitor_cleanup() leaves the outputs listed, the next one is taken before. */
+        for (output = dwl_state_output_next(ctx->state, NULL); output; output = next) {
+            next = dwl_state_output_next(ctx->state, output);
+            if ((monitor = dwl_state_output_get_data(output)))
+                monitor_cleanup(monitor);
+        }
 
-    zdwl_ipc_manager_v1_destroy(dwl_manager);
-    wl_display_disconnect(display);
+        free(ctx->totals);
+        dwl_state_disconnect(ctx->state);
+        ctx->state = NULL;
+    }
 }
 
 void die(const char* fmt, ...) {
@@ -665,6 +3858,25 @@ void die(const char* fmt, ...) {
     exit(EXIT_FAILURE);
 }
 
+void *erealloc(void *ptr, size_t size) {
+    void *new = realloc(ptr, size);
+
+    if (!new)
+        die("realloc did not allocate");
+
+    return new;
+}
+
+/* Store an error message for the caller to report, always returns ERROR. */
+int fail(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(error, sizeof(error), fmt, ap);
+    va_end(ap);
+
+    return ERROR;
+}
+
 void *ecalloc(size_t amount, size_t size) {
     void *ptr = calloc(amount, size);
 
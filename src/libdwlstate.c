@@ -0,0 +1,1042 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wayland-client-core.h>
+#include <wayland-client-protocol.h>
+#include <wayland-client.h>
+#include <wayland-util.h>
+
+#include "dwl-ipc-unstable-v1-protocol.h"
+#include "libdwlstate.h"
+#include "xdg-output-unstable-v1-protocol.h"
+
+#define CHUNK_SIZE 4096
+#define EQUAL 0
+#define ERROR -1
+#define TAG_WORDS (DWL_STATE_TAGS_MAX / 64)
+#define TEXT_MIN 64
+#define WL_ARRAY_LENGHT(array, type) ((array)->size/sizeof(type))
+#define WL_ARRAY_AT(array, type, index) ((type)(array)->data+index)
+
+/* Structures */
+/* Arena memory, strings in it stay put until the state is disconnected. */
+struct Chunk {
+    struct Chunk *next;
+    size_t length,
+           size;
+    char data[];
+};
+
+struct Interned {
+    uint32_t hash;
+    const char *string;
+    struct dwl_state_output *output; /* The output with this name, the name index. */
+};
+
+/* What dwl sent about an output, one of these is pending and one current, see output_commit(). */
+struct Output_State {
+    uint32_t active;
+    uint32_t layout;
+    char *title; /* Reused for every title, see text_set(). */
+    size_t title_size;
+    const char *appid; /* Interned, an appid change is a pointer compare. */
+    struct dwl_state_tag *tags;
+};
+
+struct dwl_state_output {
+    struct wl_list link;
+    struct dwl_state *state;
+    void *data;
+
+    uint32_t registry_name;
+    struct wl_output *wl_output;
+    struct zxdg_output_v1 *xdg_output; /* Until the name arrives. */
+    struct zdwl_ipc_output_v1 *dwl_output;
+    const char *name; /* Interned. */
+
+    int framed;        /* Has a name and a complete state, only these are handed out. */
+    int frame_pending; /* dwl framed it before the name arrived. */
+    struct Output_State states[2],
+                        *current, /* As of the last frame, the only state that is read. */
+                        *pending; /* Written by the handlers until the next frame. */
+    uint32_t pending_fields;          /* DWL_STATE_CHANGED_* of the fields written to pending since the last frame. */
+    uint64_t pending_tags[TAG_WORDS]; /* The same for every tag. */
+};
+
+struct dwl_state {
+    struct wl_display *display; /* NULL with DWL_STATE_OFFLINE. */
+    struct wl_registry *registry;
+    struct zdwl_ipc_manager_v1 *dwl_manager;
+    struct zxdg_output_manager_v1 *output_manager;
+    uint32_t flags;
+
+    /* Every name and appid once, see intern(). */
+    struct Chunk *arena;
+    struct Interned *interned;
+    size_t interned_amount,
+           interned_size;
+
+    struct wl_array tags, layouts; /* const char*, interned. */
+    struct wl_list outputs;        /* Newest first, like dwl-state always listed them. */
+    uint32_t output_amount;
+    struct dwl_state_output *active_output;
+
+    dwl_state_callback callback;
+    void *data;
+    dwl_state_event_hook hook;
+    void *hook_data;
+    int setup_step; /* Setup syncs answered, see setup_sync_done(). */
+    int syncs;      /* Sent and not answered yet. */
+    int setup_done;
+    int error; /* errno of the first handler that failed, dwl_state_dispatch() returns it. */
+};
+
+/* Functions */
+static const char *arena_add(struct dwl_state *state, const char *data, size_t length);
+static void dwl_manager_layout(void *data, struct zdwl_ipc_manager_v1 *zdwl_ipc_manager_v1, const char *name);
+static void dwl_manager_tag(void *data, struct zdwl_ipc_manager_v1 *zdwl_ipc_manager_v1, const char *name);
+static void dwl_output_active(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t active);
+static void dwl_output_appid(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, const char *appid);
+static void dwl_output_frame(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1);
+static void dwl_output_layout(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t layout);
+static void dwl_output_tag(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t index, uint32_t state, uint32_t clients, uint32_t focused);
+static void dwl_output_title(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, const char *title);
+static void dwl_output_toggle_visibility(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1);
+static void event_raise(struct dwl_state *state, const struct dwl_state_event *event);
+static void global_add(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version);
+static void global_remove(void *data, struct wl_registry *registry, uint32_t name);
+static struct Interned *intern(struct dwl_state *state, const char *string);
+static struct Interned *intern_lookup(const struct dwl_state *state, const char *string, uint32_t *hash, size_t *length);
+static int  names_add(struct dwl_state *state, struct wl_array *array, const char *name);
+static struct dwl_state_output *output_add(struct dwl_state *state, uint32_t registry_name);
+static void output_bind(struct dwl_state_output *output);
+static void output_cleanup(struct dwl_state_output *output);
+static uint32_t output_commit(struct dwl_state_output *output);
+static struct dwl_state_output *output_find(struct dwl_state *state, uint32_t registry_name);
+static void output_frame(struct dwl_state_output *output, uint32_t changes);
+static int  output_tags(struct dwl_state_output *output);
+static void setup_end(struct dwl_state *state);
+static void setup_sync_done(void *data, struct wl_callback *callback, uint32_t serial);
+static int  sync_send(struct dwl_state *state, const struct wl_callback_listener *listener);
+static void sync_done(void *data, struct wl_callback *callback, uint32_t serial);
+static int  text_set(struct dwl_state *state, char **text, size_t *size, const char *string);
+static void xdg_name(void *data, struct zxdg_output_v1 *xdg_output, const char *name);
+static void xdg_noop(void *data, struct zxdg_output_v1 *xdg_output);
+static void xdg_noop_position(void *data, struct zxdg_output_v1 *xdg_output, int32_t x, int32_t y);
+static void xdg_noop_string(void *data, struct zxdg_output_v1 *xdg_output, const char *string);
+
+/* Variables */
+static const struct zdwl_ipc_manager_v1_listener dwl_manager_listener = {
+    .tag = dwl_manager_tag,
+    .layout = dwl_manager_layout,
+};
+
+static const struct zdwl_ipc_output_v1_listener dwl_output_listener = {
+    .toggle_visibility = dwl_output_toggle_visibility,
+    .active = dwl_output_active,
+    .tag = dwl_output_tag,
+    .layout = dwl_output_layout,
+    .title = dwl_output_title,
+    .appid = dwl_output_appid,
+    .frame = dwl_output_frame,
+};
+
+static const struct wl_callback_listener setup_sync_listener = {
+    .done = setup_sync_done,
+};
+
+static const struct wl_callback_listener sync_listener = {
+    .done = sync_done,
+};
+
+static const struct wl_registry_listener registry_listener = {
+    .global = global_add,
+    .global_remove = global_remove,
+};
+
+static const struct zxdg_output_v1_listener xdg_output_listener = {
+    .name = xdg_name,
+    .logical_position = xdg_noop_position,
+    .logical_size = xdg_noop_position,
+    .done = xdg_noop,
+    .description = xdg_noop_string,
+};
+
+/*
+ * Copy into a buffer that only grows, so that a title changing on every frame
+ * doesn't allocate. Keeps the old text when out of memory, the failure is
+ * reported by dwl_state_dispatch().
+ */
+int text_set(struct dwl_state *state, char **text, size_t *size, const char *string) {
+    size_t length = strlen(string) + 1;
+    char *grown;
+
+    if (length > *size) {
+        if (!(grown = realloc(*text, length > TEXT_MIN ? length : TEXT_MIN))) {
+            state->error = ENOMEM;
+            return ERROR;
+        }
+        *text = grown;
+        *size = length > TEXT_MIN ? length : TEXT_MIN;
+    }
+
+    memcpy(*text, string, length);
+    return 0;
+}
+
+const char *arena_add(struct dwl_state *state, const char *data, size_t length) {
+    char *string;
+
+    if (!state->arena || state->arena->size - state->arena->length < length) {
+        size_t size = length > CHUNK_SIZE ? length : CHUNK_SIZE;
+        struct Chunk *chunk = calloc(1, sizeof(*chunk) + size);
+        if (!chunk)
+            return NULL;
+        chunk->size = size;
+        chunk->next = state->arena;
+        state->arena = chunk;
+    }
+
+    string = state->arena->data + state->arena->length;
+    memcpy(string, data, length);
+    state->arena->length += length;
+    return string;
+}
+
+/*
+ * The slot of string in the intern table, empty if it isn't interned.
+ * The table has to exist, hash and length are optional outputs.
+ */
+struct Interned *intern_lookup(const struct dwl_state *state, const char *string, uint32_t *hash_out, size_t *length_out) {
+    uint32_t hash = 2166136261u; /* FNV-1a */
+    size_t length, i, mask = state->interned_size - 1;
+
+    for (length = 0; string[length]; length++)
+        hash = (hash ^ (unsigned char)string[length]) * 16777619u;
+
+    for (i = hash & mask; state->interned[i].string; i = (i + 1) & mask) {
+        if (state->interned[i].hash == hash && strcmp(state->interned[i].string, string) == EQUAL)
+            break;
+    }
+
+    if (hash_out)
+        *hash_out = hash;
+    if (length_out)
+        *length_out = length;
+    return &state->interned[i];
+}
+
+/*
+ * The entry of string in the intern table, added if needed, its string is
+ * the one copy in the arena. Only valid until the next intern(), NULL when
+ * out of memory.
+ */
+struct Interned *intern(struct dwl_state *state, const char *string) {
+    struct Interned *entry;
+    uint32_t hash;
+    size_t length, i;
+
+    /* Keep the table at most half full, the size is a power of two. */
+    if (state->interned_amount * 2 >= state->interned_size) {
+        struct Interned *old = state->interned;
+        size_t old_size = state->interned_size,
+               size = old_size ? old_size * 2 : 64;
+
+        if (!(state->interned = calloc(size, sizeof(*state->interned)))) {
+            state->interned = old;
+            return NULL;
+        }
+        state->interned_size = size;
+        for (size_t j = 0; j < old_size; j++) {
+            if (!old[j].string)
+                continue;
+            for (i = old[j].hash & (size - 1); state->interned[i].string; i = (i + 1) & (size - 1));
+            state->interned[i] = old[j];
+        }
+        free(old);
+    }
+
+    entry = intern_lookup(state, string, &hash, &length);
+    if (!entry->string) {
+        if (!(entry->string = arena_add(state, string, length + 1)))
+            return NULL;
+        entry->hash = hash;
+        state->interned_amount++;
+    }
+
+    return entry;
+}
+
+int names_add(struct dwl_state *state, struct wl_array *array, const char *name) {
+    const char **ptr = wl_array_add(array, sizeof(char*));
+    struct Interned *entry = ptr ? intern(state, name) : NULL;
+
+    if (!entry) {
+        if (ptr)
+            array->size -= sizeof(char*);
+        state->error = ENOMEM;
+        return ERROR;
+    }
+
+    *ptr = entry->string;
+    return 0;
+}
+
+/* The hook sees every event before it is handled. */
+void event_raise(struct dwl_state *state, const struct dwl_state_event *event) {
+    if (state->hook)
+        state->hook(state, event, state->hook_data);
+}
+
+void dwl_manager_tag(void *data, struct zdwl_ipc_manager_v1 *zdwl_ipc_manager_v1, const char *name) {
+    struct dwl_state *state = data;
+
+    event_raise(state, &(struct dwl_state_event){DWL_STATE_EVENT_TAG_NAME, .string = name});
+    if (WL_ARRAY_LENGHT(&state->tags, char*) < DWL_STATE_TAGS_MAX)
+        names_add(state, &state->tags, name);
+}
+
+void dwl_manager_layout(void *data, struct zdwl_ipc_manager_v1 *zdwl_ipc_manager_v1, const char *name) {
+    struct dwl_state *state = data;
+
+    event_raise(state, &(struct dwl_state_event){DWL_STATE_EVENT_LAYOUT_NAME, .string = name});
+    names_add(state, &state->layouts, name);
+}
+
+void xdg_name(void *data, struct zxdg_output_v1 *xdg_output, const char *name) {
+    struct dwl_state_output *output = data;
+    struct Interned *entry;
+
+    event_raise(output->state, &(struct dwl_state_event){DWL_STATE_EVENT_OUTPUT_NAME, output->registry_name, .string = name});
+    /* There is none when fed. */
+    if (xdg_output)
+        zxdg_output_v1_destroy(xdg_output);
+    output->xdg_output = NULL;
+
+    if (output->name)
+        return;
+    if (!(entry = intern(output->state, name))) {
+        output->state->error = ENOMEM;
+        return;
+    }
+    output->name = entry->string;
+    entry->output = output;
+
+    /* Without the dwl state, the name is all there is to wait for. */
+    if (output->state->flags & DWL_STATE_NO_OUTPUT_STATE) {
+        output_frame(output, 0);
+        return;
+    }
+
+    /* An output plugged in later can get its name after the first frame. */
+    if (output->frame_pending) {
+        output->frame_pending = 0;
+        output_frame(output, output_commit(output));
+    }
+}
+
+/* Compositors send these before the name, libwayland aborts on missing handlers. */
+void xdg_noop(void *data, struct zxdg_output_v1 *xdg_output) {}
+void xdg_noop_position(void *data, struct zxdg_output_v1 *xdg_output, int32_t x, int32_t y) {}
+void xdg_noop_string(void *data, struct zxdg_output_v1 *xdg_output, const char *string) {}
+
+void dwl_output_active(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t active) {
+    struct dwl_state_output *output = data;
+
+    event_raise(output->state, &(struct dwl_state_event){DWL_STATE_EVENT_ACTIVE, output->registry_name, {active}});
+    output->pending->active = active;
+    output->pending_fields |= DWL_STATE_CHANGED_ACTIVE;
+}
+
+void dwl_output_tag(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t index, uint32_t state, uint32_t clients, uint32_t focused) {
+    struct dwl_state_output *output = data;
+
+    event_raise(output->state, &(struct dwl_state_event){DWL_STATE_EVENT_TAG, output->registry_name,
+                                                         {index, state, clients, focused}});
+    if (index >= WL_ARRAY_LENGHT(&output->state->tags, char*) || output_tags(output) == ERROR)
+        return;
+
+    output->pending->tags[index] = (struct dwl_state_tag){state, clients, focused};
+    output->pending_tags[index / 64] |= (uint64_t)1 << index % 64;
+}
+
+void dwl_output_layout(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, uint32_t layout) {
+    struct dwl_state_output *output = data;
+
+    event_raise(output->state, &(struct dwl_state_event){DWL_STATE_EVENT_LAYOUT, output->registry_name, {layout}});
+    output->pending->layout = layout;
+    output->pending_fields |= DWL_STATE_CHANGED_LAYOUT;
+}
+
+void dwl_output_title(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, const char *title) {
+    struct dwl_state_output *output = data;
+
+    event_raise(output->state, &(struct dwl_state_event){DWL_STATE_EVENT_TITLE, output->registry_name, .string = title});
+    if (text_set(output->state, &output->pending->title, &output->pending->title_size, title) != ERROR)
+        output->pending_fields |= DWL_STATE_CHANGED_TITLE;
+}
+
+void dwl_output_appid(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1, const char *appid) {
+    struct dwl_state_output *output = data;
+    struct Interned *entry;
+
+    event_raise(output->state, &(struct dwl_state_event){DWL_STATE_EVENT_APPID, output->registry_name, .string = appid});
+    if (!(entry = intern(output->state, appid))) {
+        output->state->error = ENOMEM;
+        return;
+    }
+
+    output->pending->appid = entry->string;
+    output->pending_fields |= DWL_STATE_CHANGED_APPID;
+}
+
+void dwl_output_toggle_visibility(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1) {
+    struct dwl_state_output *output = data;
+    event_raise(output->state, &(struct dwl_state_event){DWL_STATE_EVENT_TOGGLE_VISIBILITY, output->registry_name});
+}
+
+/* Without a name the frame stays pending, xdg_name() commits it. */
+void dwl_output_frame(void *data, struct zdwl_ipc_output_v1 *zdwl_ipc_output_v1) {
+    struct dwl_state_output *output = data;
+
+    event_raise(output->state, &(struct dwl_state_event){DWL_STATE_EVENT_FRAME, output->registry_name});
+    if (!output->name) {
+        output->frame_pending = 1;
+        return;
+    }
+
+    output_frame(output, output_commit(output));
+}
+
+/*
+ * Make the pending state current with a swap, so that readers only ever see
+ * whole frames, and return the DWL_STATE_CHANGED_* bits of what differs
+ * between the two. dwl sends every field before a frame, the few it might
+ * not send are taken from the current state here instead of copying it
+ * after every frame.
+ */
+uint32_t output_commit(struct dwl_state_output *output) {
+    struct Output_State *pending = output->pending, *current = output->current;
+    size_t tag_amount = WL_ARRAY_LENGHT(&output->state->tags, char*);
+    uint32_t fields = output->pending_fields, changes = 0;
+    char *text;
+    size_t size;
+
+    if (!(fields & DWL_STATE_CHANGED_ACTIVE))
+        pending->active = current->active;
+    if (!(fields & DWL_STATE_CHANGED_LAYOUT))
+        pending->layout = current->layout;
+    if (!(fields & DWL_STATE_CHANGED_APPID))
+        pending->appid = current->appid;
+    for (size_t i = 0; pending->tags && i < tag_amount; i++) {
+        if (!(output->pending_tags[i / 64] & (uint64_t)1 << i % 64))
+            pending->tags[i] = current->tags[i];
+    }
+
+    if (pending->active != current->active)
+        changes |= DWL_STATE_CHANGED_ACTIVE;
+    if (pending->layout != current->layout)
+        changes |= DWL_STATE_CHANGED_LAYOUT;
+    if (fields & DWL_STATE_CHANGED_TITLE && (!current->title || strcmp(pending->title, current->title) != EQUAL))
+        changes |= DWL_STATE_CHANGED_TITLE;
+    if (pending->appid != current->appid)
+        changes |= DWL_STATE_CHANGED_APPID;
+    /* Most frames don't touch the tags. */
+    if (pending->tags && memcmp(pending->tags, current->tags, tag_amount * sizeof(*pending->tags)) != EQUAL)
+        changes |= DWL_STATE_CHANGED_TAGS;
+
+    output->current = pending;
+    output->pending = current;
+    output->pending_fields = 0;
+    memset(output->pending_tags, 0, sizeof(output->pending_tags));
+
+    /* An unchanged title keeps its buffer, it is swapped back instead of copied. */
+    if (!(fields & DWL_STATE_CHANGED_TITLE)) {
+        text = pending->title;
+        size = pending->title_size;
+        pending->title = current->title;
+        pending->title_size = current->title_size;
+        current->title = text;
+        current->title_size = size;
+    }
+
+    if (output->current->active)
+        output->state->active_output = output;
+    else if (output->state->active_output == output)
+        output->state->active_output = NULL;
+
+    return changes;
+}
+
+/* The frames of the setup are passed to the callback too, they come before dwl_state_ready(). */
+void output_frame(struct dwl_state_output *output, uint32_t changes) {
+    struct dwl_state *state = output->state;
+
+    if (!output->framed) {
+        output->framed = 1;
+        changes |= DWL_STATE_OUTPUT_ADDED;
+    }
+
+    if (state->callback)
+        state->callback(state, output, changes, state->data);
+}
+
+/* Once the tag names are known, the tags of both states are allocated. */
+int output_tags(struct dwl_state_output *output) {
+    size_t tag_amount = WL_ARRAY_LENGHT(&output->state->tags, char*);
+
+    if (output->current->tags)
+        return 0;
+
+    output->current->tags = calloc(tag_amount ? tag_amount : 1, sizeof(*output->current->tags));
+    output->pending->tags = calloc(tag_amount ? tag_amount : 1, sizeof(*output->pending->tags));
+    if (!output->current->tags || !output->pending->tags) {
+        free(output->current->tags);
+        free(output->pending->tags);
+        output->current->tags = output->pending->tags = NULL;
+        output->state->error = ENOMEM;
+        return ERROR;
+    }
+
+    return 0;
+}
+
+struct dwl_state_output *output_add(struct dwl_state *state, uint32_t registry_name) {
+    struct dwl_state_output *output;
+
+    event_raise(state, &(struct dwl_state_event){DWL_STATE_EVENT_OUTPUT_ADD, registry_name});
+    if (!(output = calloc(1, sizeof(*output)))) {
+        state->error = ENOMEM;
+        return NULL;
+    }
+
+    output->state = state;
+    output->registry_name = registry_name;
+    output->current = &output->states[0];
+    output->pending = &output->states[1];
+    wl_list_insert(&state->outputs, &output->link);
+    state->output_amount++;
+    return output;
+}
+
+struct dwl_state_output *output_find(struct dwl_state *state, uint32_t registry_name) {
+    struct dwl_state_output *output;
+
+    wl_list_for_each(output, &state->outputs, link) {
+        if (output->registry_name == registry_name)
+            return output;
+    }
+
+    return NULL;
+}
+
+void global_add(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version) {
+    struct dwl_state *state = data;
+    struct dwl_state_output *output;
+
+    if (strcmp(interface, wl_output_interface.name) == EQUAL) {
+        if (state->flags & DWL_STATE_NO_OUTPUTS || !(output = output_add(state, name)))
+            return;
+
+        output->wl_output = wl_registry_bind(registry, name, &wl_output_interface, 1);
+        /* During setup the managers might not be bound yet, setup_sync_done() binds these. */
+        if (state->setup_step)
+            output_bind(output);
+        return;
+    }
+    if (strcmp(interface, zdwl_ipc_manager_v1_interface.name) == EQUAL) {
+        state->dwl_manager = wl_registry_bind(registry, name, &zdwl_ipc_manager_v1_interface, 2);
+        zdwl_ipc_manager_v1_add_listener(state->dwl_manager, &dwl_manager_listener, state);
+        return;
+    }
+    if (strcmp(interface, zxdg_output_manager_v1_interface.name) == EQUAL) {
+        if (state->flags & DWL_STATE_NO_OUTPUTS)
+            return;
+        state->output_manager = wl_registry_bind(registry, name, &zxdg_output_manager_v1_interface, 3);
+        return;
+    }
+}
+
+/* Outputs go away when they are unplugged, nothing else is removed while dwl runs. */
+void global_remove(void *data, struct wl_registry *registry, uint32_t name) {
+    struct dwl_state *state = data;
+    struct dwl_state_output *output;
+
+    if (!(output = output_find(state, name)))
+        return;
+
+    event_raise(state, &(struct dwl_state_event){DWL_STATE_EVENT_OUTPUT_REMOVE, name});
+    wl_list_remove(&output->link);
+    state->output_amount--;
+    if (state->active_output == output)
+        state->active_output = NULL;
+
+    if (state->callback && output->framed)
+        state->callback(state, output, DWL_STATE_OUTPUT_REMOVED, state->data);
+    output_cleanup(output);
+}
+
+void output_bind(struct dwl_state_output *output) {
+    struct dwl_state *state = output->state;
+
+    output->xdg_output = zxdg_output_manager_v1_get_xdg_output(state->output_manager, output->wl_output);
+    zxdg_output_v1_add_listener(output->xdg_output, &xdg_output_listener, output);
+
+    if (state->flags & DWL_STATE_NO_OUTPUT_STATE)
+        return;
+
+    /* Without tag names yet, the tags get allocated by the first dwl_output_tag. */
+    if (WL_ARRAY_LENGHT(&state->tags, char*))
+        output_tags(output);
+
+    output->dwl_output = zdwl_ipc_manager_v1_get_output(state->dwl_manager, output->wl_output);
+    zdwl_ipc_output_v1_add_listener(output->dwl_output, &dwl_output_listener, output);
+}
+
+/* Free the unlinked output, and let dwl know we're done with its objects. */
+void output_cleanup(struct dwl_state_output *output) {
+    struct Interned *entry;
+
+    if (output->xdg_output)
+        zxdg_output_v1_destroy(output->xdg_output);
+    if (output->dwl_output)
+        zdwl_ipc_output_v1_release(output->dwl_output);
+    if (output->wl_output)
+        wl_output_destroy(output->wl_output);
+
+    /* The name stays interned, only the index forgets the output. */
+    if (output->name) {
+        entry = intern_lookup(output->state, output->name, NULL, NULL);
+        if (entry->output == output)
+            entry->output = NULL;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        free(output->states[i].title);
+        free(output->states[i].tags);
+    }
+    free(output);
+}
+
+/* Like wl_display_roundtrip(), without waiting for it. */
+int sync_send(struct dwl_state *state, const struct wl_callback_listener *listener) {
+    struct wl_callback *callback = wl_display_sync(state->display);
+
+    if (!callback)
+        return ERROR;
+
+    state->syncs++;
+    wl_callback_add_listener(callback, listener, state);
+    return 0;
+}
+
+void sync_done(void *data, struct wl_callback *callback, uint32_t serial) {
+    struct dwl_state *state = data;
+
+    wl_callback_destroy(callback);
+    state->syncs--;
+}
+
+/*
+ * The first sync brings the globals, then everything else is requested
+ * at once. dwl answers the manager bind first, so the tag names arrive before
+ * any dwl_output tag event, and the second sync after the state of every output.
+ */
+void setup_sync_done(void *data, struct wl_callback *callback, uint32_t serial) {
+    struct dwl_state *state = data;
+    struct dwl_state_output *output;
+
+    sync_done(data, callback, serial);
+    if (state->setup_step++) {
+        setup_end(state);
+        return;
+    }
+
+    if (!state->dwl_manager || (!(state->flags & DWL_STATE_NO_OUTPUTS) && !state->output_manager)) {
+        state->error = EPROTONOSUPPORT;
+        return;
+    }
+
+    wl_list_for_each(output, &state->outputs, link)
+        output_bind(output);
+    if (sync_send(state, &setup_sync_listener) == ERROR)
+        state->error = ENOMEM;
+}
+
+void setup_end(struct dwl_state *state) {
+    struct dwl_state_output *output;
+
+    event_raise(state, &(struct dwl_state_event){DWL_STATE_EVENT_DONE});
+
+    /* In case dwl didn't send any tags for an output. */
+    if (!(state->flags & DWL_STATE_NO_OUTPUT_STATE)) {
+        wl_list_for_each(output, &state->outputs, link)
+            output_tags(output);
+    }
+    state->setup_done = 1;
+}
+
+struct dwl_state *dwl_state_new(const char *display, uint32_t flags) {
+    struct dwl_state *state = calloc(1, sizeof(*state));
+    int error;
+
+    if (!state)
+        return NULL;
+
+    wl_array_init(&state->tags);
+    wl_array_init(&state->layouts);
+    wl_list_init(&state->outputs);
+    state->flags = flags;
+    if (flags & DWL_STATE_OFFLINE)
+        return state;
+
+    if (!(state->display = wl_display_connect(display)))
+        goto fail;
+
+    state->registry = wl_display_get_registry(state->display);
+    wl_registry_add_listener(state->registry, &registry_listener, state);
+    if (sync_send(state, &setup_sync_listener) == ERROR)
+        goto fail;
+    if (wl_display_flush(state->display) == ERROR && errno != EAGAIN)
+        goto fail;
+
+    return state;
+
+fail:
+    error = errno;
+    dwl_state_disconnect(state);
+    errno = error;
+    return NULL;
+}
+
+/* dwl_state_new() and dispatching until the state is ready. */
+struct dwl_state *dwl_state_connect(const char *display) {
+    struct dwl_state *state = dwl_state_new(display, 0);
+    struct pollfd pollfd;
+    int error;
+
+    if (!state)
+        return NULL;
+
+    while (!dwl_state_ready(state)) {
+        pollfd = (struct pollfd){wl_display_get_fd(state->display), POLLIN};
+        if (wl_display_flush(state->display) == ERROR) {
+            if (errno != EAGAIN)
+                goto fail;
+            pollfd.events |= POLLOUT;
+        }
+
+        if (poll(&pollfd, 1, -1) == ERROR) {
+            if (errno == EINTR)
+                continue;
+            goto fail;
+        }
+
+        if (pollfd.revents & POLLIN) {
+            if (dwl_state_dispatch(state) == ERROR)
+                goto fail;
+        } else if (pollfd.revents & (POLLHUP | POLLERR)) {
+            errno = EPIPE;
+            goto fail;
+        }
+    }
+
+    return state;
+
+fail:
+    error = errno;
+    dwl_state_disconnect(state);
+    errno = error;
+    return NULL;
+}
+
+void dwl_state_disconnect(struct dwl_state *state) {
+    struct dwl_state_output *output, *tmp;
+    struct Chunk *chunk;
+
+    if (!state)
+        return;
+
+    wl_list_for_each_safe(output, tmp, &state->outputs, link)
+        output_cleanup(output);
+
+    if (state->dwl_manager)
+        zdwl_ipc_manager_v1_release(state->dwl_manager);
+    if (state->output_manager)
+        zxdg_output_manager_v1_destroy(state->output_manager);
+    if (state->registry)
+        wl_registry_destroy(state->registry);
+    if (state->display)
+        wl_display_disconnect(state->display);
+
+    wl_array_release(&state->tags);
+    wl_array_release(&state->layouts);
+    while ((chunk = state->arena)) {
+        state->arena = chunk->next;
+        free(chunk);
+    }
+    free(state->interned);
+    free(state);
+}
+
+int dwl_state_ready(const struct dwl_state *state) {
+    return state->setup_done && !state->syncs;
+}
+
+int dwl_state_get_fd(struct dwl_state *state) {
+    return state->display ? wl_display_get_fd(state->display) : ERROR;
+}
+
+/*
+ * libwayland reads without blocking, so after the caller polled the fd this
+ * takes whatever arrived, or nothing. The requests the handlers made are
+ * flushed right away, what doesn't fit yet goes out with dwl_state_flush().
+ */
+int dwl_state_dispatch(struct dwl_state *state) {
+    while (wl_display_prepare_read(state->display) == ERROR) {
+        if (wl_display_dispatch_pending(state->display) == ERROR)
+            return ERROR;
+    }
+
+    if (wl_display_read_events(state->display) == ERROR)
+        return ERROR;
+    if (wl_display_dispatch_pending(state->display) == ERROR)
+        return ERROR;
+    if (wl_display_flush(state->display) == ERROR && errno != EAGAIN)
+        return ERROR;
+
+    if (state->error) {
+        errno = state->error;
+        state->error = 0;
+        return ERROR;
+    }
+
+    return 0;
+}
+
+int dwl_state_flush(struct dwl_state *state) {
+    return wl_display_flush(state->display) == ERROR ? ERROR : 0;
+}
+
+int dwl_state_sync(struct dwl_state *state) {
+    return sync_send(state, &sync_listener);
+}
+
+void dwl_state_set_callback(struct dwl_state *state, dwl_state_callback callback, void *data) {
+    state->callback = callback;
+    state->data = data;
+}
+
+void dwl_state_set_event_hook(struct dwl_state *state, dwl_state_event_hook hook, void *data) {
+    state->hook = hook;
+    state->hook_data = data;
+}
+
+/* Through the same handlers as the events of dwl, without the proxies. */
+int dwl_state_feed(struct dwl_state *state, const struct dwl_state_event *event) {
+    struct dwl_state_output *output = output_find(state, event->output);
+    const char *string = event->string ? event->string : "";
+    const uint32_t *values = event->values;
+
+    switch (event->type) {
+        case DWL_STATE_EVENT_OUTPUT_ADD:
+        case DWL_STATE_EVENT_OUTPUT_REMOVE:
+        case DWL_STATE_EVENT_TAG_NAME:
+        case DWL_STATE_EVENT_LAYOUT_NAME:
+        case DWL_STATE_EVENT_DONE:
+            break;
+        default:
+            /* Events of an output need the output. */
+            if (!output || event->type > DWL_STATE_EVENT_DONE) {
+                errno = EINVAL;
+                return ERROR;
+            }
+    }
+
+    switch (event->type) {
+        case DWL_STATE_EVENT_OUTPUT_ADD:
+            if (!output && !(state->flags & DWL_STATE_NO_OUTPUTS))
+                output_add(state, event->output);
+            break;
+        case DWL_STATE_EVENT_OUTPUT_REMOVE:
+            global_remove(state, NULL, event->output);
+            break;
+        case DWL_STATE_EVENT_OUTPUT_NAME:
+            xdg_name(output, NULL, string);
+            break;
+        case DWL_STATE_EVENT_TAG_NAME:
+            dwl_manager_tag(state, NULL, string);
+            break;
+        case DWL_STATE_EVENT_LAYOUT_NAME:
+            dwl_manager_layout(state, NULL, string);
+            break;
+        case DWL_STATE_EVENT_ACTIVE:
+            dwl_output_active(output, NULL, values[0]);
+            break;
+        case DWL_STATE_EVENT_TAG:
+            dwl_output_tag(output, NULL, values[0], values[1], values[2], values[3]);
+            break;
+        case DWL_STATE_EVENT_LAYOUT:
+            dwl_output_layout(output, NULL, values[0]);
+            break;
+        case DWL_STATE_EVENT_TITLE:
+            dwl_output_title(output, NULL, string);
+            break;
+        case DWL_STATE_EVENT_APPID:
+            dwl_output_appid(output, NULL, string);
+            break;
+        case DWL_STATE_EVENT_TOGGLE_VISIBILITY:
+            dwl_output_toggle_visibility(output, NULL);
+            break;
+        case DWL_STATE_EVENT_FRAME:
+            dwl_output_frame(output, NULL);
+            break;
+        case DWL_STATE_EVENT_DONE:
+            if (!state->setup_done)
+                setup_end(state);
+            break;
+    }
+
+    if (state->error) {
+        errno = state->error;
+        state->error = 0;
+        return ERROR;
+    }
+
+    return 0;
+}
+
+uint32_t dwl_state_tag_amount(const struct dwl_state *state) {
+    return WL_ARRAY_LENGHT(&state->tags, char*);
+}
+
+const char *dwl_state_tag_name(const struct dwl_state *state, uint32_t tag) {
+    return tag < WL_ARRAY_LENGHT(&state->tags, char*) ? *WL_ARRAY_AT(&state->tags, const char**, tag) : NULL;
+}
+
+uint32_t dwl_state_layout_amount(const struct dwl_state *state) {
+    return WL_ARRAY_LENGHT(&state->layouts, char*);
+}
+
+const char *dwl_state_layout_name(const struct dwl_state *state, uint32_t layout) {
+    return layout < WL_ARRAY_LENGHT(&state->layouts, char*) ? *WL_ARRAY_AT(&state->layouts, const char**, layout) : NULL;
+}
+
+/* Outputs that weren't framed yet are skipped, like dwl-state doesn't print them. */
+struct dwl_state_output *dwl_state_output_next(const struct dwl_state *state, const struct dwl_state_output *output) {
+    const struct wl_list *link = output ? output->link.next : state->outputs.next;
+
+    for (; link != &state->outputs; link = link->next) {
+        struct dwl_state_output *next = wl_container_of(link, next, link);
+        if (next->framed)
+            return next;
+    }
+
+    return NULL;
+}
+
+/* Names are interned, so the intern table doubles as the name index. */
+struct dwl_state_output *dwl_state_output_get(const struct dwl_state *state, const char *name) {
+    struct dwl_state_output *output = NULL;
+    struct Interned *entry;
+
+    if (!state->interned_size)
+        return NULL;
+
+    entry = intern_lookup(state, name, NULL, NULL);
+    if (!entry->string)
+        return NULL;
+    if (entry->output && entry->output->framed)
+        return entry->output;
+
+    /* The indexed output went away or isn't framed, another one can have the name. */
+    while ((output = dwl_state_output_next(state, output))) {
+        if (output->name == entry->string)
+            return output;
+    }
+
+    return NULL;
+}
+
+const char *dwl_state_intern(struct dwl_state *state, const char *string) {
+    struct Interned *entry = intern(state, string);
+
+    if (!entry) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return entry->string;
+}
+
+struct dwl_state_output *dwl_state_active_output(const struct dwl_state *state) {
+    return state->active_output && state->active_output->framed ? state->active_output : NULL;
+}
+
+uint32_t dwl_state_output_amount(const struct dwl_state *state) {
+    return state->output_amount;
+}
+
+void dwl_state_output_set_data(struct dwl_state_output *output, void *data) {
+    output->data = data;
+}
+
+void *dwl_state_output_get_data(const struct dwl_state_output *output) {
+    return output->data;
+}
+
+const char *dwl_state_output_name(const struct dwl_state_output *output) {
+    return output->name;
+}
+
+int dwl_state_output_active(const struct dwl_state_output *output) {
+    return output->current->active;
+}
+
+const char *dwl_state_output_title(const struct dwl_state_output *output) {
+    return output->current->title;
+}
+
+const char *dwl_state_output_appid(const struct dwl_state_output *output) {
+    return output->current->appid;
+}
+
+uint32_t dwl_state_output_layout(const struct dwl_state_output *output) {
+    return output->current->layout;
+}
+
+int dwl_state_output_tag(const struct dwl_state_output *output, uint32_t tag, struct dwl_state_tag *result) {
+    if (tag >= WL_ARRAY_LENGHT(&output->state->tags, char*) || !output->current->tags)
+        return ERROR;
+
+    *result = output->current->tags[tag];
+    return 0;
+}
+
+const struct dwl_state_tag *dwl_state_output_tags(const struct dwl_state_output *output) {
+    return output->current->tags;
+}
+
+/* The commit swapped them into pending, nothing writes there before the callback returns. */
+const struct dwl_state_tag *dwl_state_output_previous_tags(const struct dwl_state_output *output) {
+    return output->pending->tags;
+}
+
+/* Outputs of a DWL_STATE_NO_OUTPUT_STATE or DWL_STATE_OFFLINE state have nothing to send these to. */
+void dwl_state_output_set_tags(struct dwl_state_output *output, uint32_t tags, uint32_t toggle) {
+    if (output->dwl_output)
+        zdwl_ipc_output_v1_set_tags(output->dwl_output, tags, toggle);
+}
+
+void dwl_state_output_set_layout(struct dwl_state_output *output, uint32_t layout) {
+    if (output->dwl_output)
+        zdwl_ipc_output_v1_set_layout(output->dwl_output, layout);
+}
+
+void dwl_state_output_set_client_tags(struct dwl_state_output *output, uint32_t and_tags, uint32_t xor_tags) {
+    if (output->dwl_output)
+        zdwl_ipc_output_v1_set_client_tags(output->dwl_output, and_tags, xor_tags);
+}
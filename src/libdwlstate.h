@@ -0,0 +1,174 @@
+/*
+ * libdwlstate, the state of dwl for programs that want to follow it
+ * themselves instead of running dwl-state. dwl-state is built on it too.
+ * Connect once, add the fd to your own event loop and dispatch whenever
+ * it is readable:
+ *
+ *     struct dwl_state *state = dwl_state_connect(NULL);
+ *     dwl_state_set_callback(state, changed, NULL);
+ *     struct pollfd pfd = { dwl_state_get_fd(state), POLLIN };
+ *     while (poll(&pfd, 1, -1) > 0 && dwl_state_dispatch(state) == 0)
+ *         ;
+ *
+ * See examples/bar.c for a whole program. dwl_state_new() doesn't wait
+ * for dwl, poll and dispatch until dwl_state_ready() instead, the callback
+ * then gets the outputs as dwl sends them.
+ *
+ * The accessors only ever return the state as of the last frame dwl sent
+ * for an output, never half of an update. Strings and outputs stay valid
+ * until the next dwl_state_dispatch(), copy them to keep them longer.
+ * Link with -ldwlstate and `pkg-config --libs wayland-client`. The shared
+ * library exports nothing but dwl_state_*, libdwlstate.a leaves out the
+ * code of the protocols, link the xdg-output and dwl-ipc code wayland-scanner
+ * generates with private-code along with it.
+ */
+#ifndef LIBDWLSTATE_H
+#define LIBDWLSTATE_H
+
+#include <stdint.h>
+
+/* Tags past these are ignored. */
+#define DWL_STATE_TAGS_MAX 256
+
+/* Bits of dwl_state_tag.state, the same as zdwl_ipc_output_v1_tag_state. */
+#define DWL_STATE_TAG_ACTIVE 1
+#define DWL_STATE_TAG_URGENT 2
+
+/* Bits of the changes passed to the callback. */
+#define DWL_STATE_CHANGED_ACTIVE 1
+#define DWL_STATE_CHANGED_TAGS   2
+#define DWL_STATE_CHANGED_LAYOUT 4
+#define DWL_STATE_CHANGED_TITLE  8
+#define DWL_STATE_CHANGED_APPID  16
+#define DWL_STATE_OUTPUT_ADDED   32 /* Its first frame, the other bits tell what differs from an empty output. */
+#define DWL_STATE_OUTPUT_REMOVED 64 /* It is no longer listed and freed after the callback. */
+
+/* Flags of dwl_state_new(), less to bind makes the setup faster. */
+#define DWL_STATE_NO_OUTPUTS      1 /* Only the tag and layout names. */
+#define DWL_STATE_NO_OUTPUT_STATE 2 /* Outputs without their state, listed once they have a name. */
+#define DWL_STATE_OFFLINE         4 /* Don't connect, the state is built with dwl_state_feed(). */
+
+/* Types of dwl_state_event, and what they carry. */
+#define DWL_STATE_EVENT_OUTPUT_ADD        0
+#define DWL_STATE_EVENT_OUTPUT_REMOVE     1
+#define DWL_STATE_EVENT_OUTPUT_NAME       2  /* string */
+#define DWL_STATE_EVENT_TAG_NAME          3  /* string */
+#define DWL_STATE_EVENT_LAYOUT_NAME       4  /* string */
+#define DWL_STATE_EVENT_ACTIVE            5  /* active */
+#define DWL_STATE_EVENT_TAG               6  /* index, state, clients, focused */
+#define DWL_STATE_EVENT_LAYOUT            7  /* layout */
+#define DWL_STATE_EVENT_TITLE             8  /* string */
+#define DWL_STATE_EVENT_APPID             9  /* string */
+#define DWL_STATE_EVENT_TOGGLE_VISIBILITY 10
+#define DWL_STATE_EVENT_FRAME             11
+#define DWL_STATE_EVENT_DONE              12 /* The setup is done. */
+
+struct dwl_state;
+struct dwl_state_output;
+
+struct dwl_state_tag {
+    uint32_t state;
+    uint32_t clients;
+    uint32_t focused;
+};
+
+/* An event of dwl, or of the setup. */
+struct dwl_state_event {
+    uint32_t type;      /* DWL_STATE_EVENT_* */
+    uint32_t output;    /* The registry name of the output, 0 if it isn't about one. */
+    uint32_t values[4]; /* The numbers, in the order of the protocol. */
+    const char *string;
+};
+
+typedef void (*dwl_state_callback)(struct dwl_state *state, struct dwl_state_output *output,
+                                   uint32_t changes, void *data);
+typedef void (*dwl_state_event_hook)(struct dwl_state *state, const struct dwl_state_event *event, void *data);
+
+/*
+ * Connect to display, or to WAYLAND_DISPLAY if NULL, and wait until dwl sent
+ * the state of every output. Returns NULL with errno set on failure.
+ */
+struct dwl_state *dwl_state_connect(const char *display);
+/* The same without waiting, with the DWL_STATE_* flags. */
+struct dwl_state *dwl_state_new(const char *display, uint32_t flags);
+void dwl_state_disconnect(struct dwl_state *state);
+
+/* Whether the setup is done and dwl answered every dwl_state_sync(). */
+int dwl_state_ready(const struct dwl_state *state);
+
+/* Poll this fd for POLLIN, then call dwl_state_dispatch(). */
+int dwl_state_get_fd(struct dwl_state *state);
+
+/*
+ * Read and handle the events that arrived without blocking, calling the
+ * callback once for every frame dwl sent. Returns -1 with errno set once
+ * the connection is lost, the state can still be read then.
+ */
+int dwl_state_dispatch(struct dwl_state *state);
+
+/*
+ * Send the requests made outside of dwl_state_dispatch(). Returns -1 with
+ * errno EAGAIN if they didn't fit into the socket, poll for POLLOUT too then.
+ */
+int dwl_state_flush(struct dwl_state *state);
+
+/* Ask dwl to answer once it handled every request so far, until then the state isn't ready. */
+int dwl_state_sync(struct dwl_state *state);
+
+/* Called for every frame of an output, with the DWL_STATE_CHANGED_* bits of what changed, if anything. */
+void dwl_state_set_callback(struct dwl_state *state, dwl_state_callback callback, void *data);
+
+/* Called for every event before it is handled, to count or record them. */
+void dwl_state_set_event_hook(struct dwl_state *state, dwl_state_event_hook hook, void *data);
+
+/*
+ * Handle an event like dwl sent it, to build the state of a DWL_STATE_OFFLINE
+ * one from a recording or a snapshot. Returns -1 with errno EINVAL if it is
+ * about an output that doesn't exist.
+ */
+int dwl_state_feed(struct dwl_state *state, const struct dwl_state_event *event);
+
+/* Names of the tags and layouts, index from 0. NULL if out of range. */
+uint32_t dwl_state_tag_amount(const struct dwl_state *state);
+const char *dwl_state_tag_name(const struct dwl_state *state, uint32_t tag);
+uint32_t dwl_state_layout_amount(const struct dwl_state *state);
+const char *dwl_state_layout_name(const struct dwl_state *state, uint32_t layout);
+
+/*
+ * Names and appids are kept once per state, equal ones are the same pointer.
+ * This returns that copy of string, to compare them by pointer. It lives as
+ * long as the state, NULL with errno set when out of memory.
+ */
+const char *dwl_state_intern(struct dwl_state *state, const char *string);
+
+/* Iterate the outputs by starting from NULL, until it returns NULL. */
+struct dwl_state_output *dwl_state_output_next(const struct dwl_state *state, const struct dwl_state_output *output);
+struct dwl_state_output *dwl_state_output_get(const struct dwl_state *state, const char *name);
+/* NULL if no output is active. */
+struct dwl_state_output *dwl_state_active_output(const struct dwl_state *state);
+/* Every output dwl announced, also those that aren't listed before their first frame. */
+uint32_t dwl_state_output_amount(const struct dwl_state *state);
+
+/* A pointer of your own for the output, NULL until it is set. */
+void dwl_state_output_set_data(struct dwl_state_output *output, void *data);
+void *dwl_state_output_get_data(const struct dwl_state_output *output);
+
+const char *dwl_state_output_name(const struct dwl_state_output *output);
+int dwl_state_output_active(const struct dwl_state_output *output);
+/* NULL until dwl sent one, dwl sends an empty string if nothing is focused. */
+const char *dwl_state_output_title(const struct dwl_state_output *output);
+const char *dwl_state_output_appid(const struct dwl_state_output *output);
+uint32_t dwl_state_output_layout(const struct dwl_state_output *output);
+/* Returns -1 if tag is out of range. */
+int dwl_state_output_tag(const struct dwl_state_output *output, uint32_t tag, struct dwl_state_tag *result);
+/* All dwl_state_tag_amount() tags at once, NULL if dwl sent none for the output yet. */
+const struct dwl_state_tag *dwl_state_output_tags(const struct dwl_state_output *output);
+/* The tags before the frame, to tell which changed. Only valid in the callback. */
+const struct dwl_state_tag *dwl_state_output_previous_tags(const struct dwl_state_output *output);
+
+/* Requests to dwl, sent with the next dwl_state_flush() or dwl_state_dispatch(). */
+void dwl_state_output_set_tags(struct dwl_state_output *output, uint32_t tags, uint32_t toggle);
+void dwl_state_output_set_layout(struct dwl_state_output *output, uint32_t layout);
+void dwl_state_output_set_client_tags(struct dwl_state_output *output, uint32_t and_tags, uint32_t xor_tags);
+
+#endif